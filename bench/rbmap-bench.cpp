@@ -0,0 +1,119 @@
+/**
+ *  Benchmark rb::map against std::map and the C rbtree API using the same
+ *  random-key workload: insert all keys, look each one up, erase them all.
+ *
+ *  build:  make bench
+ *  usage:  ./bench/rbmap-bench [no. of keys (default 1000000)]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <vector>
+
+#include "redblack.hpp"
+
+typedef std::chrono::steady_clock clk;
+
+static double msec (clk::time_point a, clk::time_point b)
+{
+  return std::chrono::duration<double, std::milli>(b - a).count();
+}
+
+static int icompare (const void *a, const void *b)
+{
+  const int *x = static_cast<const int *>(a),
+            *y = static_cast<const int *>(b);
+
+  return (*x > *y) - (*x < *y);
+}
+
+static void report (const char *name, double ins, double fnd, double del,
+                    long sum)
+{
+  std::printf (" %-10s insert %9.2f ms   find %9.2f ms   erase %9.2f ms"
+               "   (check %ld)\n", name, ins, fnd, del, sum);
+}
+
+template <class Map>
+static void run_map (const char *name, const std::vector<int>& keys)
+{
+  Map m;
+  long sum = 0;
+  clk::time_point t0 = clk::now();
+
+  for (size_t i = 0; i < keys.size(); i++)
+    m.emplace (keys[i], keys[i]);
+  clk::time_point t1 = clk::now();
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    typename Map::iterator it = m.find (keys[i]);
+    if (it != m.end())
+      sum += it->second;
+  }
+  clk::time_point t2 = clk::now();
+
+  for (size_t i = 0; i < keys.size(); i++)
+    m.erase (keys[i]);
+  clk::time_point t3 = clk::now();
+
+  report (name, msec (t0, t1), msec (t1, t2), msec (t2, t3), sum);
+}
+
+/* internal storage, the tree allocates a node and an int per key */
+static void run_c (const std::vector<int>& keys)
+{
+  rbtree *tree = rbcreate (icompare);
+  long sum = 0;
+
+  if (!tree)
+    std::exit (EXIT_FAILURE);
+
+  clk::time_point t0 = clk::now();
+  for (size_t i = 0; i < keys.size(); i++) {
+    int k = keys[i];
+    if (rbinsert (tree, &k, sizeof k) == rberr(tree))
+      std::exit (EXIT_FAILURE);
+  }
+  clk::time_point t1 = clk::now();
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    int k = keys[i];
+    rbnode *node = rbfind (tree, &k);
+    if (node)
+      sum += *static_cast<int *>(node->data);
+  }
+  clk::time_point t2 = clk::now();
+
+  for (size_t i = 0; i < keys.size(); i++) {
+    int k = keys[i];
+    rbnode *node = rbfind (tree, &k);
+    if (node)
+      std::free (rbdelete (tree, node));
+  }
+  clk::time_point t3 = clk::now();
+
+  rbdestroy (tree, std::free);
+
+  report ("C rbtree", msec (t0, t1), msec (t1, t2), msec (t2, t3), sum);
+}
+
+int main (int argc, char **argv)
+{
+  size_t n = argc > 1 ? (size_t)std::atol (argv[1]) : 1000000;
+  std::vector<int> keys(n);
+  std::mt19937 gen(42);
+
+  for (size_t i = 0; i < n; i++)
+    keys[i] = static_cast<int>(gen() % (10 * n + 1));
+
+  std::printf ("\n %zu random int keys:\n\n", n);
+
+  run_map<rb::map<int, int> > ("rb::map", keys);
+  run_map<std::map<int, int> > ("std::map", keys);
+  run_c (keys);
+
+  return 0;
+}
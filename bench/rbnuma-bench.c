@@ -0,0 +1,150 @@
+/**
+ *  Benchmark lookup latency from every NUMA node for one shared tree
+ *  (allocated on node 0) and for rbnuma with a replica per node. Keys are
+ *  looked up in random order so most hops miss the cache.
+ *
+ *  build:  make bench   (add -DRBNUMA to CFLAGS and -lnuma to LDFLAGS
+ *                        for more than one node)
+ *  usage:  ./bench/rbnuma-bench [keys (default 1000000)]
+ *                               [lookups per thread (default 2000000)]
+ */
+
+#define _GNU_SOURCE               /* clock_gettime(), numa_run_on_node() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef RBNUMA
+#include <numa.h>
+#endif
+
+#include "redblack.h"
+#include "rbnuma.h"
+
+struct job {
+  rbnuma *rn;
+  int node;
+  int *keys;
+  size_t nkeys, n;
+  double ns;                  /* per lookup */
+};
+
+static int icompare (const void *a, const void *b)
+{
+  const int *x = a,
+            *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+static double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void pin (int node)
+{
+#ifdef RBNUMA
+  numa_run_on_node (node);
+#else
+  (void)node;
+#endif
+}
+
+static void *lookup (void *arg)
+{
+  struct job *job = arg;
+  unsigned long r = 88172645463325252UL;
+  size_t i;
+  double t0;
+
+  pin (job->node);
+  rbncount (job->rn);         /* replay the log into the local replica */
+
+  t0 = now();
+  for (i = 0; i < job->n; i++) {
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    if (!rbnfind (job->rn, job->keys + r % job->nkeys))
+      abort();
+  }
+  job->ns = (now() - t0) * 1e9 / job->n;
+
+  return NULL;
+}
+
+/*
+ * Load keys from node 0, then time lookups from a thread on each node.
+ */
+static void run (int *keys, size_t nkeys, size_t n, size_t nreplicas,
+                 int nnodes, double *ns)
+{
+  pthread_t th[64];
+  struct job jobs[64];
+  rbnuma *rn;
+  size_t i;
+  int k;
+
+  pin (0);
+  if (!(rn = rbncreate (icompare, sizeof *keys, nreplicas)))
+    exit (EXIT_FAILURE);
+  for (i = 0; i < nkeys; i++)
+    rbninsert (rn, keys + i);
+
+  /* one node at a time so threads do not compete for memory bandwidth */
+  for (k = 0; k < nnodes; k++) {
+    jobs[k].rn = rn;
+    jobs[k].node = k;
+    jobs[k].keys = keys;
+    jobs[k].nkeys = nkeys;
+    jobs[k].n = n;
+    pthread_create (th + k, NULL, lookup, jobs + k);
+    pthread_join (th[k], NULL);
+    ns[k] = jobs[k].ns;
+  }
+
+  rbndestroy (rn);
+}
+
+int main (int argc, char **argv)
+{
+  size_t nkeys = argc > 1 ? (size_t)atol (argv[1]) : 1000000,
+         n = argc > 2 ? (size_t)atol (argv[2]) : 2000000,
+         i;
+  double shared[64], replicated[64];
+  int *keys, nnodes = 1, k;
+
+#ifdef RBNUMA
+  if (numa_available () >= 0)
+    nnodes = numa_max_node () + 1;
+#endif
+  if (nkeys < 1 || n < 1 || nnodes > 64) {
+    fputs ("error: invalid argument.\n", stderr);
+    return 1;
+  }
+  if (!(keys = malloc (nkeys * sizeof *keys))) {
+    perror ("malloc-keys");
+    return 1;
+  }
+
+  /* distinct keys in scrambled order (odd multiplier mod 2^31) */
+  for (i = 0; i < nkeys; i++)
+    keys[i] = (int)((i * 2654435761u) & 0x7fffffff);
+
+  run (keys, nkeys, n, 1, nnodes, shared);
+  run (keys, nkeys, n, 0, nnodes, replicated);
+
+  printf ("\n %lu keys, %d NUMA node(s), ns per lookup:\n\n"
+          "   node   shared (node 0)   replicated\n",
+          (unsigned long)nkeys, nnodes);
+  for (k = 0; k < nnodes; k++)
+    printf ("   %4d   %15.1f   %10.1f\n", k, shared[k], replicated[k]);
+
+  free (keys);
+
+  return 0;
+}
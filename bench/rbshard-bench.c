@@ -0,0 +1,161 @@
+/**
+ *  Benchmark write throughput against thread count for a single rbtree
+ *  behind one mutex and for rbshard with hash and range partitioning.
+ *  Each thread inserts its own share of distinct keys, then deletes them.
+ *
+ *  build:  make bench
+ *  usage:  ./bench/rbshard-bench [keys per thread (default 200000)]
+ *                                [max threads (default 8)] [shards (16)]
+ */
+
+#define _POSIX_C_SOURCE 200112L   /* clock_gettime() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "redblack.h"
+#include "rbshard.h"
+
+enum kind { locked, hashed, ranged };
+
+struct job {
+  enum kind kind;
+  void *tree;
+  pthread_mutex_t *lock;      /* single tree only */
+  int *keys;
+  size_t n;
+};
+
+static int icompare (const void *a, const void *b)
+{
+  const int *x = a,
+            *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+static size_t ihash (const void *a)
+{
+  return (size_t)(unsigned)*(const int *)a * 2654435761u;
+}
+
+static double now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *worker (void *arg)
+{
+  struct job *job = arg;
+  rbnode *node;
+  size_t i;
+
+  for (i = 0; i < job->n; i++) {
+    if (job->kind == locked) {
+      pthread_mutex_lock (job->lock);
+      rbinsert (job->tree, job->keys + i, sizeof *job->keys);
+      pthread_mutex_unlock (job->lock);
+    }
+    else {
+      rbsinsert (job->tree, job->keys + i, sizeof *job->keys);
+    }
+  }
+
+  for (i = 0; i < job->n; i++) {
+    if (job->kind == locked) {
+      pthread_mutex_lock (job->lock);
+      if ((node = rbfind (job->tree, job->keys + i)))
+        free (rbdelete (job->tree, node));
+      pthread_mutex_unlock (job->lock);
+    }
+    else {
+      free (rbsdelete (job->tree, job->keys + i));
+    }
+  }
+
+  return NULL;
+}
+
+static double run (enum kind kind, int *keys, size_t n, size_t nthreads,
+                   size_t nshards)
+{
+  pthread_t th[64];
+  struct job jobs[64];
+  pthread_mutex_t lock;
+  void *tree;
+  double t0, t1;
+  size_t i;
+
+  pthread_mutex_init (&lock, NULL);
+  if (kind == locked)
+    tree = rbcreate (icompare);
+  else
+    tree = rbscreate (icompare, nshards, kind == hashed ? ihash : NULL,
+                      sizeof *keys);
+  if (!tree)
+    exit (EXIT_FAILURE);
+
+  t0 = now();
+  for (i = 0; i < nthreads; i++) {
+    jobs[i].kind = kind;
+    jobs[i].tree = tree;
+    jobs[i].lock = &lock;
+    jobs[i].keys = keys + i * n;
+    jobs[i].n = n;
+    pthread_create (th + i, NULL, worker, jobs + i);
+  }
+  for (i = 0; i < nthreads; i++)
+    pthread_join (th[i], NULL);
+  t1 = now();
+
+  if (kind == locked)
+    rbdestroy (tree, free);
+  else
+    rbsdestroy (tree, free);
+  pthread_mutex_destroy (&lock);
+
+  /* million writes (inserts + deletes) per second */
+  return 2.0 * n * nthreads / (t1 - t0) / 1e6;
+}
+
+int main (int argc, char **argv)
+{
+  size_t n = argc > 1 ? (size_t)atol (argv[1]) : 200000,
+         maxthreads = argc > 2 ? (size_t)atol (argv[2]) : 8,
+         nshards = argc > 3 ? (size_t)atol (argv[3]) : 16,
+         t, i;
+  int *keys;
+
+  if (n < 1 || maxthreads < 1 || maxthreads > 64 || nshards < 1) {
+    fputs ("error: invalid argument.\n", stderr);
+    return 1;
+  }
+  if (!(keys = malloc (n * maxthreads * sizeof *keys))) {
+    perror ("malloc-keys");
+    return 1;
+  }
+
+  /* distinct keys in scrambled order (odd multiplier mod 2^31) */
+  for (i = 0; i < n * maxthreads; i++)
+    keys[i] = (int)((i * 2654435761u) & 0x7fffffff);
+
+  printf ("\n %lu keys per thread, %lu shards, Mwrites/s:\n\n"
+          "   threads   single+mutex   rbshard-hash   rbshard-range\n",
+          (unsigned long)n, (unsigned long)nshards);
+
+  for (t = 1; t <= maxthreads; t *= 2)
+    printf ("   %7lu   %12.2f   %12.2f   %13.2f\n", (unsigned long)t,
+            run (locked, keys, n, t, nshards),
+            run (hashed, keys, n, t, nshards),
+            run (ranged, keys, n, t, nshards));
+
+  free (keys);
+
+  return 0;
+}
@@ -0,0 +1,145 @@
+/**
+ *  Benchmark the wide-node tree (rbwide.c) against the red-black tree at
+ *  several sizes, with and without inline key prefixes. Keys are random
+ *  ints held in one array (external storage) so both engines store the
+ *  same data pointers.
+ *
+ *  build:  make bench
+ *  usage:  ./bench/rbwide-bench [largest no. of keys (default 1000000)]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "redblack.h"
+#include "rbwide.h"
+
+static int icompare (const void *a, const void *b)
+{
+  const int *x = a,
+            *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+/* order-preserving prefix of an int key */
+static unsigned long iprefix (const void *a)
+{
+  return (unsigned long)((long)*(const int *)a - (-2147483647L - 1));
+}
+
+static double secs (clock_t a, clock_t b)
+{
+  return (double)(b - a) / CLOCKS_PER_SEC;
+}
+
+static void report (const char *name, double ins, double fnd, double del,
+                    long found)
+{
+  printf ("   %-16s insert %8.3f s   find %8.3f s   delete %8.3f s"
+          "   (found %ld)\n", name, ins, fnd, del, found);
+}
+
+static void run_rb (const char *name, int *keys, int *probe, size_t n,
+                    int prefix)
+{
+  rbtree *tree = rbcreate (icompare);
+  rbnode *node;
+  clock_t t0, t1, t2, t3;
+  long found = 0;
+  size_t i;
+
+  if (!tree)
+    exit (EXIT_FAILURE);
+  if (prefix)
+    rbsetprefix (tree, iprefix);
+
+  t0 = clock();
+  for (i = 0; i < n; i++)
+    if (rbinsert (tree, keys + i, 0) == rberr(tree))
+      exit (EXIT_FAILURE);
+  t1 = clock();
+  for (i = 0; i < n; i++)
+    found += rbfind (tree, probe + i) != NULL;
+  t2 = clock();
+  for (i = 0; i < n; i++)
+    if ((node = rbfind (tree, keys + i)))
+      rbdelete (tree, node);
+  t3 = clock();
+
+  rbdestroy (tree, NULL);
+  report (name, secs (t0, t1), secs (t1, t2), secs (t2, t3), found);
+}
+
+static void run_wide (const char *name, int *keys, int *probe, size_t n,
+                      int prefix)
+{
+  rbwide *tree = rbwcreate (icompare);
+  clock_t t0, t1, t2, t3;
+  long found = 0;
+  size_t i;
+
+  if (!tree)
+    exit (EXIT_FAILURE);
+  if (prefix)
+    rbwsetprefix (tree, iprefix);
+
+  t0 = clock();
+  for (i = 0; i < n; i++)
+    if (rbwinsert (tree, keys + i, 0) == rbwerr(tree))
+      exit (EXIT_FAILURE);
+  t1 = clock();
+  for (i = 0; i < n; i++)
+    found += rbwfind (tree, probe + i) != NULL;
+  t2 = clock();
+  for (i = 0; i < n; i++)
+    rbwdelete (tree, keys + i);
+  t3 = clock();
+
+  rbwdestroy (tree, NULL);
+  report (name, secs (t0, t1), secs (t1, t2), secs (t2, t3), found);
+}
+
+int main (int argc, char **argv)
+{
+  size_t max = argc > 1 ? (size_t)atol (argv[1]) : 1000000,
+         n, i;
+  int *keys, *probe;
+
+  if (max < 1) {
+    fputs ("error: number of keys requested < 1.\n", stderr);
+    return 1;
+  }
+  if (!(keys = malloc (max * sizeof *keys)) ||
+      !(probe = malloc (max * sizeof *probe))) {
+    perror ("malloc-keys");
+    return 1;
+  }
+
+  srand (42);
+  for (n = max < 10000 ? max : 10000; ; n *= 10) {
+    if (n > max)
+      n = max;
+
+    for (i = 0; i < n; i++) {
+      keys[i] = rand();
+      probe[i] = keys[rand() % n];
+    }
+
+    printf ("\n %lu keys (wide node degree %d):\n\n",
+            (unsigned long)n, RBWDEGREE);
+    run_rb ("rbtree", keys, probe, n, 0);
+    run_rb ("rbtree+prefix", keys, probe, n, 1);
+    run_wide ("rbwide", keys, probe, n, 0);
+    run_wide ("rbwide+prefix", keys, probe, n, 1);
+
+    if (n == max)
+      break;
+  }
+
+  free (keys);
+  free (probe);
+
+  return 0;
+}
@@ -0,0 +1,509 @@
+/**
+ *  NUMA replicated redblack tree for read-mostly data.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#ifdef RBNUMA
+#define _GNU_SOURCE         /* sched_getcpu() */
+#else
+#define _XOPEN_SOURCE 600   /* pthread_rwlock_t with -std=c89 */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef RBNUMA
+#include <sched.h>
+#include <numa.h>
+#endif
+
+#include "rbnuma.h"
+
+/*
+ * Every pointer hop of a lookup in a tree allocated on another NUMA node
+ * pays the cross-node latency. rbnuma keeps one replica of the tree per
+ * node (built with -DRBNUMA and linked with -lnuma, otherwise there is a
+ * single node) and routes each call to the replica of the node the
+ * calling thread runs on.
+ *
+ * Writes go to an operation log: a writer brings its own replica up to
+ * date, applies the write there and appends it to the log, all under the
+ * log lock, so writes are totally ordered. Other replicas replay the log
+ * the next time a thread on their node uses them, so their nodes are
+ * allocated by (and first touched on) that node. A log grown past
+ * RBNLOGMAX entries is replayed into every replica by rbnsync(), which
+ * does so from a thread run on each replica's node for the same reason.
+ *
+ * Every replica copies typesz bytes per data item (internal storage).
+ * Data pointers returned point into the caller's local replica and, as
+ * with rbshard, may be freed by a later delete.
+ */
+
+#ifndef RBNLOGMAX
+#define RBNLOGMAX 4096      /* log entries before a writer syncs all */
+#endif
+
+typedef struct rbnentry {
+  struct rbnentry *next;
+  unsigned long seq;
+  size_t refs;        /* replicas whose last applied entry this is, or
+                         which are yet to reach it */
+  int del;            /* delete, else insert */
+} rbnentry;           /* typesz bytes of data follow */
+
+typedef struct rbnrep {
+  pthread_rwlock_t lock;
+  rbtree *tree;
+  rbnentry *last;     /* last entry applied */
+  char pad[64];       /* keep neighbouring replicas off one cache line */
+} rbnrep;
+
+#define rbndata(e)  ((void *)((e) + 1))
+
+#ifdef __GNUC__
+#define rbnseq_load(p)      __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define rbnseq_store(p, v)  __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#else
+#define rbnseq_load(p)      (*(volatile unsigned long *)(p))
+#define rbnseq_store(p, v)  (*(volatile unsigned long *)(p) = (v))
+#endif
+
+/*
+ * Replica of the node the calling thread runs on.
+ */
+static rbnrep *rbnlocal (rbnuma *rn)
+{
+#ifdef RBNUMA
+  int cpu = sched_getcpu (),
+      node = cpu < 0 ? 0 : numa_node_of_cpu (cpu);
+
+  return rn->rep + (node < 0 ? 0 : (size_t)node % rn->nreplicas);
+#else
+  return rn->rep;
+#endif
+}
+
+/*
+ * Replay the log entries after r->last up to and including *end into r,
+ * which the caller holds for writing. Returns 0, or -1 if an insert ran
+ * out of memory, with *end moved back to the last entry applied so that
+ * the failed one is tried again by the next replay.
+ */
+static int rbnreplay (rbnuma *rn, rbnrep *r, rbnentry **end)
+{
+  rbnentry *e, *prev;
+  rbnode *node;
+
+  for (e = r->last; e != *end; ) {
+    prev = e;
+    e = e->next;
+    if (e->del) {
+      if ((node = rbfind (r->tree, rbndata(e))))
+        free (rbdelete (r->tree, node));
+    }
+    else if (rbinsert (r->tree, rbndata(e), rn->typesz) == rberr(r->tree)) {
+      *end = prev;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Move r->last on to end, freeing the entries no replica needs any more.
+ * The log lock must be held.
+ */
+static void rbnrelease (rbnuma *rn, rbnrep *r, rbnentry *end)
+{
+  rbnentry *e, *next;
+
+  for (e = r->last; e != end; e = next) {
+    next = e->next;
+    if (--e->refs == 0) {
+      free (e);
+      rn->loglen--;
+    }
+  }
+  r->last = end;
+}
+
+/*
+ * Bring r, held for writing, up to date with the log. Replaying happens
+ * outside the log lock so writers on other nodes are not held up.
+ * Returns 0, or -1 if r could only be brought part of the way.
+ */
+static int rbncatchup (rbnuma *rn, rbnrep *r)
+{
+  rbnentry *end;
+  int ret;
+
+  pthread_mutex_lock (&rn->loglock);
+  end = rn->tail;
+  pthread_mutex_unlock (&rn->loglock);
+
+  if (r->last == end)
+    return 0;
+
+  ret = rbnreplay (rn, r, &end);
+
+  pthread_mutex_lock (&rn->loglock);
+  rbnrelease (rn, r, end);
+  pthread_mutex_unlock (&rn->loglock);
+
+  return ret;
+}
+
+/*
+ * Take the local replica for reading, once it has caught up with every
+ * write completed before the call. Returns NULL, holding nothing, if it
+ * could not catch up.
+ */
+static rbnrep *rbnenter (rbnuma *rn)
+{
+  rbnrep *r = rbnlocal (rn);
+  int err;
+
+  pthread_rwlock_rdlock (&r->lock);
+  if (r->last->seq != rbnseq_load (&rn->seq)) {
+    pthread_rwlock_unlock (&r->lock);
+    pthread_rwlock_wrlock (&r->lock);
+    err = rbncatchup (rn, r);
+    pthread_rwlock_unlock (&r->lock);
+    if (err)
+      return NULL;
+    pthread_rwlock_rdlock (&r->lock);
+  }
+
+  return r;
+}
+
+/*
+ * Create a replicated tree using compar whose data items are typesz bytes
+ * (non-zero). nreplicas 0 gives one replica per NUMA node, 1 a single
+ * shared tree. Returns the empty tree or NULL on failure.
+ */
+rbnuma *rbncreate (int (*compar)(const void *, const void *), size_t typesz,
+                   size_t nreplicas)
+{
+  rbnuma *rn;
+  size_t i;
+
+  if (typesz == 0)
+    return NULL;
+
+  if (nreplicas == 0) {
+#ifdef RBNUMA
+    nreplicas = numa_available () < 0 ? 1 : (size_t)numa_max_node () + 1;
+#else
+    nreplicas = 1;
+#endif
+  }
+
+  if (!(rn = calloc (1, sizeof *rn))) {
+    perror ("calloc-rn-rbncreate()");
+    return NULL;
+  }
+  if (!(rn->rep = calloc (nreplicas, sizeof *rn->rep))) {
+    perror ("calloc-rep-rbncreate()");
+    free (rn);
+    return NULL;
+  }
+  /* every replica starts out having applied an empty first entry */
+  if (!(rn->tail = calloc (1, sizeof *rn->tail))) {
+    perror ("calloc-tail-rbncreate()");
+    free (rn->rep);
+    free (rn);
+    return NULL;
+  }
+  rn->tail->refs = nreplicas;
+  rn->loglen = 1;
+
+  rn->compar = compar;
+  rn->typesz = typesz;
+  rn->nreplicas = nreplicas;
+  pthread_mutex_init (&rn->loglock, NULL);
+
+  for (i = 0; i < nreplicas; i++) {
+    rn->rep[i].last = rn->tail;
+    if (!(rn->rep[i].tree = rbcreate (compar))) {
+      rn->nreplicas = i;
+      rbndestroy (rn);
+      return NULL;
+    }
+    pthread_rwlock_init (&rn->rep[i].lock, NULL);
+  }
+
+  return rn;
+}
+
+/*
+ * Apply a write to the caller's replica and log it for the others. e is
+ * the new entry, its data filled in. For a delete the entry takes a copy
+ * of the data found. Returns as rbninsert()/rbndelete() do.
+ */
+static void *rbnwrite (rbnuma *rn, rbnentry *e)
+{
+  rbnrep *r = rbnlocal (rn);
+  rbnentry *end;
+  rbnode *node;
+  void *ret = NULL;
+  int logged = 0, full;
+
+  pthread_rwlock_wrlock (&r->lock);
+  pthread_mutex_lock (&rn->loglock);
+
+  /* the write goes after every logged one, or not at all */
+  end = rn->tail;
+  if (rbnreplay (rn, r, &end) != 0) {
+    rbnrelease (rn, r, end);
+    pthread_mutex_unlock (&rn->loglock);
+    pthread_rwlock_unlock (&r->lock);
+    free (e);
+    return rbnerr(rn);
+  }
+  rbnrelease (rn, r, end);
+
+  node = rbfind (r->tree, rbndata(e));
+  if (e->del) {
+    if (node) {
+      memcpy (rbndata(e), node->data, rn->typesz);
+      ret = rbdelete (r->tree, node);
+      logged = 1;
+    }
+  }
+  else if (node) {
+    ret = node->data;
+  }
+  else if (rbinsert (r->tree, rbndata(e), rn->typesz)) {
+    ret = rbnerr(rn);
+  }
+  else {
+    logged = 1;
+  }
+
+  /* a write that changed nothing here changes nothing elsewhere */
+  if (logged && rn->nreplicas > 1) {
+    e->next = NULL;
+    e->seq = rn->tail->seq + 1;
+    e->refs = rn->nreplicas;
+    rn->tail->next = e;
+    rn->tail = e;
+    rn->loglen++;
+    rbnrelease (rn, r, e);
+    rbnseq_store (&rn->seq, e->seq);
+  }
+  else {
+    free (e);
+  }
+  full = rn->loglen > RBNLOGMAX;
+
+  pthread_mutex_unlock (&rn->loglock);
+  pthread_rwlock_unlock (&r->lock);
+
+  /* the write is done, a replica left behind catches up later */
+  if (full)
+    rbnsync (rn);
+
+  return ret;
+}
+
+/*
+ * Allocate a log entry holding a copy of the typesz bytes at data.
+ */
+static rbnentry *rbnentry_new (rbnuma *rn, const void *data, int del)
+{
+  rbnentry *e;
+
+  if (!(e = malloc (sizeof *e + rn->typesz))) {
+    perror ("malloc-e-rbnentry_new()");
+    return NULL;
+  }
+  memcpy (rbndata(e), data, rn->typesz);
+  e->del = del;
+
+  return e;
+}
+
+/*
+ * Insert a copy of the typesz bytes at data into every replica. Returns
+ * NULL on success, the existing data if a matching key is already
+ * present, or rbnerr(rn) on allocation failure.
+ */
+void *rbninsert (rbnuma *rn, void *data)
+{
+  rbnentry *e;
+
+  if (!(e = rbnentry_new (rn, data, 0)))
+    return rbnerr(rn);
+
+  return rbnwrite (rn, e);
+}
+
+/*
+ * Look for key in the local replica. Returns its data, NULL if not found,
+ * or rbnerr(rn) if the replica ran out of memory catching up with the log
+ * (it tries again on the next call).
+ */
+void *rbnfind (rbnuma *rn, const void *key)
+{
+  rbnrep *r;
+  rbnode *node;
+  void *data;
+
+  if (!(r = rbnenter (rn)))
+    return rbnerr(rn);
+
+  node = rbfind (r->tree, (void *)key);
+  data = node ? node->data : NULL;
+  pthread_rwlock_unlock (&r->lock);
+
+  return data;
+}
+
+/*
+ * Delete key from every replica and return the local replica's data
+ * (pass to free()), or NULL if not found. key must point to typesz
+ * readable bytes. Returns rbnerr(rn) on allocation failure.
+ */
+void *rbndelete (rbnuma *rn, const void *key)
+{
+  rbnentry *e;
+
+  if (!(e = rbnentry_new (rn, key, 1)))
+    return rbnerr(rn);
+
+  return rbnwrite (rn, e);
+}
+
+/*
+ * Number of keys, as seen by the local replica, or (size_t)-1 if it ran
+ * out of memory catching up with the log.
+ */
+size_t rbncount (rbnuma *rn)
+{
+  rbnrep *r;
+  size_t n;
+
+  if (!(r = rbnenter (rn)))
+    return (size_t)-1;
+
+  n = rbsize(r->tree);
+  pthread_rwlock_unlock (&r->lock);
+
+  return n;
+}
+
+/*
+ * Bring replica i up to date from the calling thread. Returns 0, or -1
+ * if it ran out of memory.
+ */
+static int rbnsync_rep (rbnuma *rn, size_t i)
+{
+  int ret;
+
+  pthread_rwlock_wrlock (&rn->rep[i].lock);
+  ret = rbncatchup (rn, rn->rep + i);
+  pthread_rwlock_unlock (&rn->rep[i].lock);
+
+  return ret;
+}
+
+#ifdef RBNUMA
+struct rbnjob {
+  rbnuma *rn;
+  size_t i;
+  pthread_t th;
+  int started,
+      err;
+};
+
+/*
+ * Thread bringing replica i up to date from node i, where rbnlocal()
+ * sends that node's threads, so the nodes it allocates are local there.
+ */
+static void *rbnsync_node (void *arg)
+{
+  struct rbnjob *job = arg;
+
+  numa_run_on_node ((int)job->i);
+  job->err = rbnsync_rep (job->rn, job->i);
+
+  return NULL;
+}
+#endif
+
+/*
+ * Replay the log into every replica, each from a thread run on the
+ * replica's node (built with -DRBNUMA, where a thread can be had), else
+ * from the calling thread. Called by writers when the log grows long,
+ * e.g. because no thread runs on some node, and useful after a bulk load.
+ * Returns 0, or -1 if some replica ran out of memory and is left behind
+ * (its next catch-up tries again).
+ */
+int rbnsync (rbnuma *rn)
+{
+  size_t i;
+  int err = 0;
+#ifdef RBNUMA
+  struct rbnjob *jobs = NULL;
+
+  if (rn->nreplicas > 1 && !(jobs = malloc (rn->nreplicas * sizeof *jobs)))
+    perror ("malloc-jobs-rbnsync()");
+
+  if (jobs) {
+    for (i = 0; i < rn->nreplicas; i++) {
+      jobs[i].rn = rn;
+      jobs[i].i = i;
+      jobs[i].err = 0;
+      jobs[i].started = pthread_create (&jobs[i].th, NULL, rbnsync_node,
+                                        jobs + i) == 0;
+      if (!jobs[i].started)
+        jobs[i].err = rbnsync_rep (rn, i);
+    }
+    for (i = 0; i < rn->nreplicas; i++) {
+      if (jobs[i].started)
+        pthread_join (jobs[i].th, NULL);
+      err |= jobs[i].err;
+    }
+    free (jobs);
+    return err;
+  }
+#endif
+
+  for (i = 0; i < rn->nreplicas; i++)
+    err |= rbnsync_rep (rn, i);
+
+  return err;
+}
+
+/*
+ * Destroy every replica and the log. No other thread may be using rn.
+ */
+void rbndestroy (rbnuma *rn)
+{
+  size_t i;
+
+  for (i = 0; i < rn->nreplicas; i++) {
+    rbnrelease (rn, rn->rep + i, rn->tail);
+    rbdestroy (rn->rep[i].tree, free);
+    pthread_rwlock_destroy (&rn->rep[i].lock);
+  }
+  pthread_mutex_destroy (&rn->loglock);
+
+  free (rn->tail);
+  free (rn->rep);
+  free (rn);
+}
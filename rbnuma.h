@@ -0,0 +1,62 @@
+/**
+ *  NUMA replicated redblack tree for read-mostly data.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#ifndef _RBNUMA_H
+#define _RBNUMA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "redblack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbnrep;
+struct rbnentry;
+
+typedef struct rbnuma {
+  int (*compar)(const void *, const void *);
+  size_t typesz,                    /* bytes copied per data item */
+         nreplicas;
+  struct rbnrep *rep;
+
+  /* operation log, see rbnuma.c */
+  pthread_mutex_t loglock;          /* appends and entry release */
+  struct rbnentry *tail;            /* newest entry */
+  unsigned long seq;                /* sequence number of tail */
+  size_t loglen;                    /* entries not yet freed */
+  char err;
+} rbnuma;
+
+#define rbnerr(n)           ((void *)&(n)->err)
+
+rbnuma *rbncreate           (int (*)(const void *, const void *), size_t,
+                            size_t);
+void *rbninsert             (rbnuma *, void *);
+void *rbnfind               (rbnuma *, const void *);
+void *rbndelete             (rbnuma *, const void *);
+size_t rbncount             (rbnuma *);
+int rbnsync                 (rbnuma *);
+void rbndestroy             (rbnuma *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RBNUMA_H */
@@ -0,0 +1,536 @@
+/**
+ *  Sharded, concurrently accessible set of redblack trees.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rbshard.h"
+
+/*
+ * A single rbtree behind one lock serializes every writer. rbshard splits
+ * the keys over nshards independent rbtrees, each behind its own mutex, so
+ * writers to different shards proceed in parallel. Each shard's nodes come
+ * from the allocating thread's malloc arena, so shards do not share an
+ * allocator lock either.
+ *
+ * Keys are either hash-partitioned (hash(key) % nshards, even spread, no
+ * ordering between shards) or range-partitioned (shard i holds the keys
+ * from bound i up to bound i + 1, so shards are in key order). Range
+ * bounds are copies of bndsz bytes of a data item, compar must be able to
+ * compare a key against such a copy. When one range shard grows past
+ * twice its fair share the keys are redistributed evenly and the bounds
+ * moved, see rbsrebalance().
+ *
+ * rbsinsert(), rbsfind() and rbsdelete() may be called from any number of
+ * threads. They return data pointers rather than rbnodes since a node may
+ * be deleted (or moved by a rebalance) as soon as the shard is unlocked.
+ *
+ * Operations share no lock: a range operation reads the bounds unlocked,
+ * locks the shard they point to and then checks that no rebalance has
+ * run since, trying again if one has. A rebalance holds every shard lock
+ * while it moves nodes and bounds, and keeps rs->seq odd while it writes
+ * the bounds. compar only ever sees a private copy of a bound, taken
+ * while rs->seq stayed even and unchanged, never one half rewritten.
+ */
+
+/* shard size below which no rebalance is triggered */
+#define RBSMINLIMIT 1024
+
+#define RBSBNDSTACK 64      /* bounds this small are copied on the stack */
+
+typedef struct rbspart {
+  pthread_mutex_t lock;
+  rbtree *tree;
+  char pad[64];       /* keep neighbouring locks off one cache line */
+} rbspart;
+
+#define rbsbound(s, i)  ((s)->bounds + (i) * (s)->bndsz)
+
+#ifdef __GNUC__
+#define rbsseq_load(p)      __atomic_load_n ((p), __ATOMIC_ACQUIRE)
+#define rbsseq_store(p, v)  __atomic_store_n ((p), (v), __ATOMIC_RELEASE)
+#define rbsbyte_load(p)     __atomic_load_n ((p), __ATOMIC_RELAXED)
+#define rbsbyte_store(p, v) __atomic_store_n ((p), (v), __ATOMIC_RELAXED)
+#define rbsfence_acquire()  __atomic_thread_fence (__ATOMIC_ACQUIRE)
+#define rbsfence_release()  __atomic_thread_fence (__ATOMIC_RELEASE)
+#else
+#define rbsseq_load(p)      (*(volatile size_t *)(p))
+#define rbsseq_store(p, v)  (*(volatile size_t *)(p) = (v))
+#define rbsbyte_load(p)     (*(volatile char *)(p))
+#define rbsbyte_store(p, v) (*(volatile char *)(p) = (v))
+#define rbsfence_acquire()
+#define rbsfence_release()
+#endif
+
+/* room for one bound on the stack, aligned for any scalar type */
+union rbsbndtmp {
+  char buf[RBSBNDSTACK];
+  long double ld;
+  void *p;
+  long l;
+};
+
+/*
+ * Copy bound i into buf while a rebalance may be writing it, one byte at
+ * a time so no store is raced. Returns 0 if rs->seq is still seq after
+ * the copy, so the copy is whole, -1 otherwise.
+ */
+static int rbsbound_get (rbshard *rs, size_t i, size_t seq, char *buf)
+{
+  const char *src = rbsbound(rs, i);
+  size_t j;
+
+  for (j = 0; j < rs->bndsz; j++)
+    buf[j] = rbsbyte_load (src + j);
+  rbsfence_acquire();
+
+  return rbsseq_load (&rs->seq) == seq ? 0 : -1;
+}
+
+/*
+ * Bound i becomes a copy of data. Only called with rs->seq odd.
+ */
+static void rbsbound_set (rbshard *rs, size_t i, const void *data)
+{
+  const char *src = data;
+  char *dst = rbsbound(rs, i);
+  size_t j;
+
+  for (j = 0; j < rs->bndsz; j++)
+    rbsbyte_store (dst + j, src[j]);
+}
+
+/*
+ * Index of the shard holding key, as of rs->seq == seq. A route made
+ * while a rebalance runs is bad, which rbsenter() catches; the bounds
+ * compar sees are whole copies all the same.
+ */
+static size_t rbsroute (rbshard *rs, const void *key, size_t seq)
+{
+  union rbsbndtmp stack;
+  char *buf = stack.buf;
+  const void *bound;
+  size_t lo = 0, hi, mid;
+  int locked = 0;
+
+  if (rs->hash)
+    return rs->hash (key) % rs->nshards;
+
+  /* bounds being written: locking any shard waits the rebalance out */
+  if (seq & 1)
+    return 0;
+
+  /* no room for a copy, read the bounds with rebalances held off */
+  if (rs->bndsz > sizeof stack && !(buf = malloc (rs->bndsz))) {
+    perror ("malloc-buf-rbsroute()");
+    pthread_mutex_lock (&rs->rebal);
+    locked = 1;
+  }
+
+  hi = rbsseq_load (&rs->active);
+
+  /* last shard whose lower bound is <= key, shard 0 has none */
+  while (hi - lo > 1) {
+    mid = lo + (hi - lo) / 2;
+    if (locked)
+      bound = rbsbound(rs, mid);
+    else if (rbsbound_get (rs, mid, seq, buf) == 0)
+      bound = buf;
+    else {
+      lo = 0;
+      break;
+    }
+    if (rs->compar (key, bound) >= 0)
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  if (locked)
+    pthread_mutex_unlock (&rs->rebal);
+  else if (buf != stack.buf)
+    free (buf);
+
+  return lo;
+}
+
+/*
+ * Lock and return the shard holding key. A route read while a rebalance
+ * moved the bounds shows up as a changed rs->seq once the shard is
+ * locked, and is made again.
+ */
+static rbspart *rbsenter (rbshard *rs, const void *key)
+{
+  rbspart *p;
+  size_t seq;
+
+  for (;;) {
+    seq = rbsseq_load (&rs->seq);
+    p = rs->part + rbsroute (rs, key, seq);
+    pthread_mutex_lock (&p->lock);
+    if (rs->hash || rbsseq_load (&rs->seq) == seq)
+      return p;
+    pthread_mutex_unlock (&p->lock);
+  }
+}
+
+/*
+ * Create a sharded tree of nshards rbtrees using compar. If hash is not
+ * NULL keys are hash-partitioned, otherwise range-partitioned with bounds
+ * of bndsz bytes copied from the data (bndsz must be non-zero). Returns
+ * the empty tree or NULL on failure.
+ */
+rbshard *rbscreate (int (*compar)(const void *, const void *), size_t nshards,
+                    size_t (*hash)(const void *), size_t bndsz)
+{
+  rbshard *rs;
+  size_t i;
+
+  if (nshards == 0 || (!hash && bndsz == 0))
+    return NULL;
+
+  if (!(rs = calloc (1, sizeof *rs))) {
+    perror ("calloc-rs-rbscreate()");
+    return NULL;
+  }
+  if (!(rs->part = calloc (nshards, sizeof *rs->part))) {
+    perror ("calloc-part-rbscreate()");
+    free (rs);
+    return NULL;
+  }
+  if (!hash && !(rs->bounds = malloc (nshards * bndsz))) {
+    perror ("malloc-bounds-rbscreate()");
+    free (rs->part);
+    free (rs);
+    return NULL;
+  }
+
+  rs->compar = compar;
+  rs->hash = hash;
+  rs->nshards = nshards;
+  rs->bndsz = bndsz;
+  rs->active = hash ? nshards : 1;  /* range shards open up on rebalance */
+  rs->limit = RBSMINLIMIT;
+  pthread_mutex_init (&rs->rebal, NULL);
+
+  for (i = 0; i < nshards; i++) {
+    if (!(rs->part[i].tree = rbcreate (compar))) {
+      rs->nshards = i;
+      rbsdestroy (rs, NULL);
+      return NULL;
+    }
+    pthread_mutex_init (&rs->part[i].lock, NULL);
+  }
+
+  return rs;
+}
+
+/*
+ * Insert data (see rbinsert() for typesz). Returns NULL on success, the
+ * existing data if a matching key is already present, or rbserr(rs) on
+ * allocation failure. May trigger a rebalance of range shards.
+ */
+void *rbsinsert (rbshard *rs, void *data, size_t typesz)
+{
+  rbspart *p;
+  rbnode *node;
+  void *ret;
+  int grow;
+
+  p = rbsenter (rs, data);
+  if (!(node = rbinsert (p->tree, data, typesz)))
+    ret = NULL;
+  else if (node == rberr(p->tree))
+    ret = rbserr(rs);
+  else
+    ret = node->data;
+  /* rs->limit only changes with every shard locked, p among them */
+  grow = !rs->hash && !ret && rbsize(p->tree) > rs->limit;
+  pthread_mutex_unlock (&p->lock);
+
+  if (grow)
+    rbsrebalance (rs);
+
+  return ret;
+}
+
+/*
+ * Look for key. Returns its data or NULL if not found.
+ */
+void *rbsfind (rbshard *rs, const void *key)
+{
+  rbspart *p;
+  rbnode *node;
+  void *data;
+
+  p = rbsenter (rs, key);
+  node = rbfind (p->tree, (void *)key);
+  data = node ? node->data : NULL;
+  pthread_mutex_unlock (&p->lock);
+
+  return data;
+}
+
+/*
+ * Delete key and return its data (pass to free() for internal storage),
+ * or NULL if not found.
+ */
+void *rbsdelete (rbshard *rs, const void *key)
+{
+  rbspart *p;
+  rbnode *node;
+  void *data = NULL;
+
+  p = rbsenter (rs, key);
+  if ((node = rbfind (p->tree, (void *)key)))
+    data = rbdelete (p->tree, node);
+  pthread_mutex_unlock (&p->lock);
+
+  return data;
+}
+
+/*
+ * Number of keys, a snapshot that may be stale under concurrent writes.
+ * Counts summed while a rebalance moved keys between shards are summed
+ * again.
+ */
+size_t rbscount (rbshard *rs)
+{
+  size_t seq, i, n;
+
+  do {
+    seq = rbsseq_load (&rs->seq);
+    for (i = 0, n = 0; i < rs->nshards; i++) {
+      pthread_mutex_lock (&rs->part[i].lock);
+      n += rbsize(rs->part[i].tree);
+      pthread_mutex_unlock (&rs->part[i].lock);
+    }
+  } while (rbsseq_load (&rs->seq) != seq);
+
+  return n;
+}
+
+/*
+ * Merge the hash shards, which must all be locked, calling func in key
+ * order. Returns the first non-zero func return, 0, or -1 if out of memory.
+ */
+static int rbsmerge (rbshard *rs, int (*func)(void *, void *), void *cookie)
+{
+  rbnode **cur, *min;
+  size_t i, m = 0;
+  int error = 0;
+
+  if (!(cur = malloc (rs->nshards * sizeof *cur))) {
+    perror ("malloc-cur-rbsmerge()");
+    return -1;
+  }
+  for (i = 0; i < rs->nshards; i++)
+    cur[i] = rbmin (rs->part[i].tree);
+
+  for (;;) {
+    min = NULL;
+    for (i = 0, m = 0; i < rs->nshards; i++) {
+      if (cur[i] == rbnil(rs->part[i].tree))
+        continue;
+      if (!min || rs->compar (cur[i]->data, min->data) < 0) {
+        min = cur[i];
+        m = i;
+      }
+    }
+    if (!min || (error = func (min->data, cookie)) != 0)
+      break;
+    cur[m] = rbsuccessor (rs->part[m].tree, min);
+  }
+
+  free (cur);
+
+  return error;
+}
+
+/*
+ * Call func() for the data of every key in order, passing it a cookie,
+ * stopping and returning the value if func() returns non-zero. Range
+ * shards are visited one after another, each locked in turn (writers to
+ * other shards continue), hash shards are all locked and merged. func()
+ * must not call back into rs. Returns 0 on successful traversal.
+ */
+int rbsapply (rbshard *rs, int (*func)(void *, void *), void *cookie)
+{
+  size_t i;
+  int error = 0;
+
+  if (rs->hash) {
+    for (i = 0; i < rs->nshards; i++)
+      pthread_mutex_lock (&rs->part[i].lock);
+    error = rbsmerge (rs, func, cookie);
+    for (i = rs->nshards; i-- > 0; )
+      pthread_mutex_unlock (&rs->part[i].lock);
+    return error;
+  }
+
+  /* holding the rebalance lock keeps keys from moving under us */
+  pthread_mutex_lock (&rs->rebal);
+  for (i = 0; i < rs->active && !error; i++) {
+    pthread_mutex_lock (&rs->part[i].lock);
+    error = rbapply (rs->part[i].tree, func, cookie, inorder);
+    pthread_mutex_unlock (&rs->part[i].lock);
+  }
+  pthread_mutex_unlock (&rs->rebal);
+
+  return error;
+}
+
+/*
+ * Link node, just unlinked from another shard, into tree as it is: it
+ * stays tree-owned and keeps its data.
+ */
+static void rbsrelink (rbtree *tree, rbnode *node)
+{
+  rbnode *iter = rbfirst(tree),
+         *parent = rbroot(tree);
+  int res = 0;
+
+  while (iter != rbnil(tree)) {
+    parent = iter;
+    res = tree->compar (node->data, iter->data);
+    iter = res < 0 ? iter->left : iter->right;
+  }
+  rblink (tree, parent, node, res);
+}
+
+/*
+ * rbsrebalance() with the rebalance lock and every shard lock held.
+ */
+static int _rbsrebalance (rbshard *rs)
+{
+  rbnode **nodes, *node;
+  rbtree *src;
+  size_t *start, i, k, n = 0, max = 0, per, dst, active;
+
+  for (i = 0; i < rs->nshards; i++) {
+    n += rbsize(rs->part[i].tree);
+    if (rbsize(rs->part[i].tree) > max)
+      max = rbsize(rs->part[i].tree);
+  }
+
+  /* another thread may have rebalanced while we waited */
+  if (max <= rs->limit || n == 0)
+    return 0;
+
+  if (!(nodes = malloc (n * sizeof *nodes))) {
+    perror ("malloc-nodes-rbsrebalance()");
+    return -1;
+  }
+  if (!(start = malloc ((rs->nshards + 1) * sizeof *start))) {
+    perror ("malloc-start-rbsrebalance()");
+    free (nodes);
+    return -1;
+  }
+
+  /* shards are in key order, so this lists every node in key order,
+   * nodes[start[i]] .. nodes[start[i + 1] - 1] being those of shard i.
+   */
+  for (i = 0, k = 0; i < rs->nshards; i++) {
+    src = rs->part[i].tree;
+    start[i] = k;
+    for (node = rbmin (src); node != rbnil(src); node = rbsuccessor (src, node))
+      nodes[k++] = node;
+  }
+  start[i] = k;
+
+  /* shard i takes nodes[i * n / active] up to the next shard's first, so
+   * every shard gets n / active nodes or one more and none is empty.
+   */
+  active = n < rs->nshards ? n : rs->nshards;
+  per = (n + active - 1) / active;
+
+  /* relink every node whose shard changes */
+  for (i = 0; i < rs->nshards; i++) {
+    src = rs->part[i].tree;
+    for (k = start[i]; k < start[i + 1]; k++) {
+      if ((dst = ((k + 1) * active - 1) / n) == i)
+        continue;
+      node = nodes[k];
+      rbunlink (src, node);
+      rbsrelink (rs->part[dst].tree, node);
+    }
+  }
+
+  /* odd while the bounds are written, routes read before now are stale */
+  rbsseq_store (&rs->seq, rs->seq + 1);
+  rbsfence_release();
+  for (i = 1; i < active; i++)
+    rbsbound_set (rs, i, nodes[i * n / active]->data);
+  rbsseq_store (&rs->active, active);
+  rs->limit = 2 * per < RBSMINLIMIT ? RBSMINLIMIT : 2 * per;
+  rbsseq_store (&rs->seq, rs->seq + 1);
+
+  free (start);
+  free (nodes);
+
+  return 0;
+}
+
+/*
+ * Redistribute the keys of a range-partitioned tree evenly over all
+ * shards and move the bounds to match, if any shard has grown past twice
+ * its fair share. rbsinsert() calls it when that happens, so it rarely
+ * needs calling directly. Runs with every shard locked; nodes are
+ * relinked into their new shard, nothing is allocated but one temporary
+ * array. Returns 0 on success (or for hash partitioning), -1 if out of
+ * memory (the tree is unchanged).
+ */
+int rbsrebalance (rbshard *rs)
+{
+  size_t i;
+  int ret;
+
+  if (rs->hash)
+    return 0;
+
+  /* shards are locked in index order, as rbsapply() does */
+  pthread_mutex_lock (&rs->rebal);
+  for (i = 0; i < rs->nshards; i++)
+    pthread_mutex_lock (&rs->part[i].lock);
+
+  ret = _rbsrebalance (rs);
+
+  for (i = rs->nshards; i-- > 0; )
+    pthread_mutex_unlock (&rs->part[i].lock);
+  pthread_mutex_unlock (&rs->rebal);
+
+  return ret;
+}
+
+/*
+ * Destroy every shard (see rbdestroy()) and the sharded tree itself. No
+ * other thread may be using rs.
+ */
+void rbsdestroy (rbshard *rs, void (*destroy)(void *))
+{
+  size_t i;
+
+  for (i = 0; i < rs->nshards; i++) {
+    rbdestroy (rs->part[i].tree, destroy);
+    pthread_mutex_destroy (&rs->part[i].lock);
+  }
+  pthread_mutex_destroy (&rs->rebal);
+
+  free (rs->bounds);
+  free (rs->part);
+  free (rs);
+}
@@ -0,0 +1,64 @@
+/**
+ *  Sharded, concurrently accessible set of redblack trees.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#ifndef _RBSHARD_H
+#define _RBSHARD_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+#include "redblack.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rbspart;
+
+typedef struct rbshard {
+  int (*compar)(const void *, const void *);
+  size_t (*hash)(const void *);     /* NULL when range-partitioned */
+  size_t nshards;
+  struct rbspart *part;
+
+  /* range partitioning, see rbscreate() */
+  pthread_mutex_t rebal;            /* held by rebalance and range apply */
+  size_t seq;                       /* odd while a rebalance writes bounds */
+  size_t bndsz,                     /* bytes copied per bound */
+         active,                    /* shards in use, 1 .. nshards */
+         limit;                     /* shard size that triggers rebalance */
+  char *bounds;                     /* lower bound of shard i at i * bndsz */
+  char err;
+} rbshard;
+
+#define rbserr(s)           ((void *)&(s)->err)
+
+rbshard *rbscreate          (int (*)(const void *, const void *), size_t,
+                            size_t (*)(const void *), size_t);
+void *rbsinsert             (rbshard *, void *, size_t);
+void *rbsfind               (rbshard *, const void *);
+void *rbsdelete             (rbshard *, const void *);
+size_t rbscount             (rbshard *);
+int rbsapply                (rbshard *, int (*)(void *, void *), void *);
+int rbsrebalance            (rbshard *);
+void rbsdestroy             (rbshard *, void (*)(void *));
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RBSHARD_H */
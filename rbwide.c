@@ -0,0 +1,511 @@
+/**
+ *  Wide-node (B-tree) alternative to the redblack tree.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbwide.h"
+
+/*
+ * B-tree, see Cormen, Leiserson, Rivest & Stein, chapter 18.
+ *
+ * Each node holds up to 2t - 1 keys in sorted order in contiguous arrays,
+ * so a lookup touches one node (a handful of adjacent cache lines) per
+ * level instead of one rbnode per level, and the tree is about log2(t)
+ * times shallower than the red-black tree. Nodes are split on the way down
+ * during insertion and topped up (borrowing from a sibling or merging) on
+ * the way down during deletion, so neither operation has to walk back up.
+ *
+ * The tree stores the same data pointers as rbtree, with the same internal
+ * and external storage rules for rbwinsert(). Since keys move between
+ * nodes as they split and merge there are no stable node handles, find,
+ * min and max return the data pointer and delete takes a key.
+ */
+
+#define RBWMAX  (2 * RBWDEGREE - 1)
+
+typedef struct rbwnode {
+  int n;                            /* number of keys in use */
+  int leaf;
+  unsigned long pfx[RBWMAX];        /* inline prefixes, see rbwsetprefix() */
+  void *data[RBWMAX];
+  struct rbwnode *child[RBWMAX + 1];  /* unused in leaves */
+} rbwnode;
+
+/*
+ * Allocate an empty node.
+ */
+static rbwnode *rbwnode_new (int leaf)
+{
+  rbwnode *node;
+
+  if (!(node = malloc (sizeof *node))) {
+    perror ("malloc-node-rbwnode_new()");
+    return NULL;
+  }
+  node->n = 0;
+  node->leaf = leaf;
+
+  return node;
+}
+
+/*
+ * Move cnt keys from src[si] to dst[di], the ranges may overlap.
+ */
+static void rbwmove (rbwnode *dst, int di, rbwnode *src, int si, int cnt)
+{
+  memmove (dst->pfx + di, src->pfx + si, cnt * sizeof *dst->pfx);
+  memmove (dst->data + di, src->data + si, cnt * sizeof *dst->data);
+}
+
+/*
+ * Move cnt child pointers from src[si] to dst[di], may overlap.
+ */
+static void rbwmovec (rbwnode *dst, int di, rbwnode *src, int si, int cnt)
+{
+  memmove (dst->child + di, src->child + si, cnt * sizeof *dst->child);
+}
+
+/*
+ * Compare key (with prefix pfx) against key i of node.
+ */
+static int rbwcompare (rbwide *tree, const void *key, unsigned long pfx,
+                       const rbwnode *node, int i)
+{
+  if (tree->prefix && pfx != node->pfx[i])
+    return pfx < node->pfx[i] ? -1 : 1;
+
+  return tree->compar (key, node->data[i]);
+}
+
+/*
+ * Binary search of node for key. Returns the index of the matching key
+ * and sets *found, otherwise the index of the child to descend into.
+ */
+static int rbwsearch (rbwide *tree, const void *key, unsigned long pfx,
+                      const rbwnode *node, int *found)
+{
+  int lo = 0, hi = node->n, mid, res;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if ((res = rbwcompare (tree, key, pfx, node, mid)) == 0) {
+      *found = 1;
+      return mid;
+    }
+    if (res < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  *found = 0;
+
+  return lo;
+}
+
+/*
+ * Split the full child i of node, moving its median key up into node.
+ * node must not be full. Returns 0 on success, -1 on allocation failure.
+ */
+static int rbwsplit (rbwnode *node, int i)
+{
+  rbwnode *y = node->child[i],
+          *z;
+
+  if (!(z = rbwnode_new (y->leaf)))
+    return -1;
+
+  /* upper t - 1 keys (and t children) of y go to z */
+  z->n = RBWDEGREE - 1;
+  rbwmove (z, 0, y, RBWDEGREE, RBWDEGREE - 1);
+  if (!y->leaf)
+    rbwmovec (z, 0, y, RBWDEGREE, RBWDEGREE);
+  y->n = RBWDEGREE - 1;
+
+  /* open a slot in node for the median and the new child */
+  rbwmovec (node, i + 2, node, i + 1, node->n - i);
+  node->child[i + 1] = z;
+  rbwmove (node, i + 1, node, i, node->n - i);
+  rbwmove (node, i, y, RBWDEGREE - 1, 1);
+  node->n++;
+
+  return 0;
+}
+
+/*
+ * Merge child i + 1 of node and the separating key into child i.
+ */
+static void rbwmerge (rbwnode *node, int i)
+{
+  rbwnode *y = node->child[i],
+          *z = node->child[i + 1];
+
+  rbwmove (y, y->n, node, i, 1);
+  rbwmove (y, y->n + 1, z, 0, z->n);
+  if (!y->leaf)
+    rbwmovec (y, y->n + 1, z, 0, z->n + 1);
+  y->n += z->n + 1;
+
+  rbwmove (node, i, node, i + 1, node->n - i - 1);
+  rbwmovec (node, i + 1, node, i + 2, node->n - i - 1);
+  node->n--;
+
+  free (z);
+}
+
+/*
+ * Make sure child i of node has at least t keys before descending into
+ * it, by borrowing from a sibling or merging with one. Returns the index
+ * of the child to descend into (it changes when merged with the left).
+ */
+static int rbwfill (rbwnode *node, int i)
+{
+  rbwnode *c = node->child[i],
+          *sib;
+
+  if (c->n >= RBWDEGREE)
+    return i;
+
+  if (i > 0 && (sib = node->child[i - 1])->n >= RBWDEGREE) {
+    /* rotate right through the separating key */
+    rbwmove (c, 1, c, 0, c->n);
+    rbwmove (c, 0, node, i - 1, 1);
+    if (!c->leaf) {
+      rbwmovec (c, 1, c, 0, c->n + 1);
+      c->child[0] = sib->child[sib->n];
+    }
+    rbwmove (node, i - 1, sib, sib->n - 1, 1);
+    sib->n--;
+    c->n++;
+  }
+  else if (i < node->n && (sib = node->child[i + 1])->n >= RBWDEGREE) {
+    /* rotate left through the separating key */
+    rbwmove (c, c->n, node, i, 1);
+    if (!c->leaf)
+      c->child[c->n + 1] = sib->child[0];
+    rbwmove (node, i, sib, 0, 1);
+    rbwmove (sib, 0, sib, 1, sib->n - 1);
+    if (!sib->leaf)
+      rbwmovec (sib, 0, sib, 1, sib->n);
+    sib->n--;
+    c->n++;
+  }
+  else if (i < node->n) {
+    rbwmerge (node, i);
+  }
+  else {
+    rbwmerge (node, i - 1);
+    i--;
+  }
+
+  return i;
+}
+
+/*
+ * Create a wide tree using the specified compare routine.
+ * Allocates and returns the initialized (empty) tree.
+ */
+rbwide *rbwcreate (int (*compar)(const void *, const void *))
+{
+  rbwide *tree;
+
+  if (!(tree = malloc (sizeof *tree))) {
+    perror ("malloc-tree-rbwcreate()");
+    return NULL;
+  }
+  tree->compar = compar;
+  tree->prefix = NULL;
+  tree->root = NULL;
+  tree->count = 0;
+
+  return tree;
+}
+
+/*
+ * Keep an inline key prefix for every key, as rbsetprefix() does for the
+ * red-black tree. The prefixes sit in their own array in each node, so the
+ * binary search within a node only dereferences data when prefixes tie.
+ * Must be set while the tree is empty, returns 0 on success, -1 otherwise.
+ */
+int rbwsetprefix (rbwide *tree, unsigned long (*prefix)(const void *))
+{
+  if (tree->count)
+    return -1;
+
+  tree->prefix = prefix;
+
+  return 0;
+}
+
+/*
+ * Insert data into the tree. If typesz is non-zero, typesz bytes are
+ * allocated for data and data copied into the tree, otherwise the data
+ * pointer is stored (see rbinsert()).
+ * Returns NULL on success, the existing data if a key matching "data" is
+ * already in the tree, or rbwerr(tree) on allocation failure.
+ */
+void *rbwinsert (rbwide *tree, void *data, size_t typesz)
+{
+  unsigned long pfx = tree->prefix ? tree->prefix (data) : 0;
+  rbwnode *node;
+  int i, found, res;
+
+  if (!tree->root && !(tree->root = rbwnode_new (1)))
+    return rbwerr(tree);
+
+  /* a full root is split first, the tree grows at the top */
+  if (tree->root->n == RBWMAX) {
+    if (!(node = rbwnode_new (0)))
+      return rbwerr(tree);
+    node->child[0] = tree->root;
+    if (rbwsplit (node, 0) != 0) {
+      free (node);
+      return rbwerr(tree);
+    }
+    tree->root = node;
+  }
+
+  node = tree->root;
+  for (;;) {
+    i = rbwsearch (tree, data, pfx, node, &found);
+    if (found)
+      return node->data[i];
+
+    if (node->leaf)
+      break;
+
+    /* split a full child before descending so there is room for a key */
+    if (node->child[i]->n == RBWMAX) {
+      if (rbwsplit (node, i) != 0)
+        return rbwerr(tree);
+      if ((res = rbwcompare (tree, data, pfx, node, i)) == 0)
+        return node->data[i];
+      if (res > 0)
+        i++;
+    }
+    node = node->child[i];
+  }
+
+  rbwmove (node, i + 1, node, i, node->n - i);
+  if (typesz != 0) {
+    if (!(node->data[i] = malloc (typesz))) {
+      perror ("malloc-data-rbwinsert()");
+      rbwmove (node, i, node, i + 1, node->n - i);
+      return rbwerr(tree);
+    }
+    memcpy (node->data[i], data, typesz);
+  }
+  else {
+    node->data[i] = data;
+  }
+  node->pfx[i] = pfx;
+  node->n++;
+  tree->count++;
+
+  return NULL;
+}
+
+/*
+ * Look for the data matching key in tree.
+ * Returns the data pointer if found, else NULL.
+ */
+void *rbwfind (rbwide *tree, const void *key)
+{
+  unsigned long pfx = tree->prefix ? tree->prefix (key) : 0;
+  rbwnode *node = tree->root;
+  int i, found;
+
+  while (node) {
+    i = rbwsearch (tree, key, pfx, node, &found);
+    if (found)
+      return node->data[i];
+    node = node->leaf ? NULL : node->child[i];
+  }
+
+  return NULL;
+}
+
+/*
+ * rbwmin - the data with the minimum key value in tree, NULL if empty.
+ */
+void *rbwmin (rbwide *tree)
+{
+  rbwnode *node = tree->root;
+
+  if (!node || !node->n)
+    return NULL;
+
+  while (!node->leaf)
+    node = node->child[0];
+
+  return node->data[0];
+}
+
+/*
+ * rbwmax - the data with the maximum key value in tree, NULL if empty.
+ */
+void *rbwmax (rbwide *tree)
+{
+  rbwnode *node = tree->root;
+
+  if (!node || !node->n)
+    return NULL;
+
+  while (!node->leaf)
+    node = node->child[node->n];
+
+  return node->data[node->n - 1];
+}
+
+/*
+ * Recursive portion of rbwapply().
+ */
+static int _rbwapply (rbwnode *node, int (*func)(void *, void *),
+                      void *cookie)
+{
+  int i, error;
+
+  for (i = 0; i < node->n; i++) {
+    if (!node->leaf && (error = _rbwapply (node->child[i], func, cookie)))
+      return error;
+    if ((error = func (node->data[i], cookie)) != 0)
+      return error;
+  }
+  if (!node->leaf)
+    return _rbwapply (node->child[i], func, cookie);
+
+  return 0;
+}
+
+/*
+ * Call func() for each key in order, passing it the data and a cookie.
+ * If func() returns non-zero the traversal stops and the error value is
+ * returned. Returns 0 on successful traversal.
+ */
+int rbwapply (rbwide *tree, int (*func)(void *, void *), void *cookie)
+{
+  return tree->root ? _rbwapply (tree->root, func, cookie) : 0;
+}
+
+/*
+ * Recursive portion of rbwdelete(), node has at least t keys unless it
+ * is the root.
+ */
+static void *_rbwdelete (rbwide *tree, rbwnode *node, const void *key,
+                         unsigned long pfx)
+{
+  rbwnode *y;
+  void *data;
+  int i, found;
+
+  for (;;) {
+    i = rbwsearch (tree, key, pfx, node, &found);
+
+    if (found && node->leaf) {
+      data = node->data[i];
+      rbwmove (node, i, node, i + 1, node->n - i - 1);
+      node->n--;
+      return data;
+    }
+
+    if (found) {
+      data = node->data[i];
+
+      /* replace by the predecessor or successor, taken from whichever
+       * side can spare a key, or merge the two sides and go on down.
+       */
+      if (node->child[i]->n >= RBWDEGREE) {
+        for (y = node->child[i]; !y->leaf; y = y->child[y->n]) {}
+        rbwmove (node, i, y, y->n - 1, 1);
+        _rbwdelete (tree, node->child[i], node->data[i], node->pfx[i]);
+        return data;
+      }
+      if (node->child[i + 1]->n >= RBWDEGREE) {
+        for (y = node->child[i + 1]; !y->leaf; y = y->child[0]) {}
+        rbwmove (node, i, y, 0, 1);
+        _rbwdelete (tree, node->child[i + 1], node->data[i], node->pfx[i]);
+        return data;
+      }
+      rbwmerge (node, i);
+      node = node->child[i];
+      continue;
+    }
+
+    if (node->leaf)
+      return NULL;
+
+    node = node->child[rbwfill (node, i)];
+  }
+}
+
+/*
+ * Delete the key matching key from the tree and return its data pointer,
+ * or NULL if it is not in the tree. With internal storage the data must
+ * be passed to free() by the caller, as for rbdelete().
+ */
+void *rbwdelete (rbwide *tree, const void *key)
+{
+  unsigned long pfx = tree->prefix ? tree->prefix (key) : 0;
+  rbwnode *root = tree->root;
+  void *data;
+
+  if (!root)
+    return NULL;
+
+  if ((data = _rbwdelete (tree, root, key, pfx)))
+    tree->count--;
+
+  /* an emptied root shrinks the tree by one level */
+  if (root->n == 0) {
+    tree->root = root->leaf ? NULL : root->child[0];
+    free (root);
+  }
+
+  return data;
+}
+
+/*
+ * Recursive portion of rbwdestroy().
+ */
+static void _rbwdestroy (rbwnode *node, void (*destroy)(void *))
+{
+  int i;
+
+  for (i = 0; i < node->n; i++) {
+    if (!node->leaf)
+      _rbwdestroy (node->child[i], destroy);
+    if (destroy != NULL)
+      destroy (node->data[i]);
+  }
+  if (!node->leaf)
+    _rbwdestroy (node->child[i], destroy);
+
+  free (node);
+}
+
+/*
+ * Destroy the specified tree, calling the destructor destroy for each
+ * key's data and then freeing the tree itself.
+ */
+void rbwdestroy (rbwide *tree, void (*destroy)(void *))
+{
+  if (tree->root)
+    _rbwdestroy (tree->root, destroy);
+
+  free (tree);
+}
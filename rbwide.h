@@ -0,0 +1,64 @@
+/**
+ *  Wide-node (B-tree) alternative to the redblack tree.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+#ifndef _RBWIDE_H
+#define _RBWIDE_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Minimum degree of the wide tree, every node but the root holds between
+ * RBWDEGREE - 1 and 2 * RBWDEGREE - 1 keys.
+ */
+#ifndef RBWDEGREE
+#define RBWDEGREE 8
+#endif
+
+struct rbwnode;
+
+typedef struct rbwide {
+  int (*compar)(const void *, const void *);
+  unsigned long (*prefix)(const void *);
+  struct rbwnode *root;
+  size_t count;
+  char err;
+} rbwide;
+
+#define rbwerr(t)           ((void *)&(t)->err)
+#define rbwcount(t)         ((t)->count)
+
+rbwide *rbwcreate           (int (*)(const void *, const void *));
+int rbwsetprefix            (rbwide *, unsigned long (*)(const void *));
+void *rbwinsert             (rbwide *, void *, size_t);
+
+void *rbwfind               (rbwide *, const void *);
+void *rbwmin                (rbwide *);
+void *rbwmax                (rbwide *);
+int rbwapply                (rbwide *, int (*)(void *, void *), void *);
+
+void rbwdestroy             (rbwide *, void (*)(void *));
+void *rbwdelete             (rbwide *, const void *);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RBWIDE_H */
@@ -58,12 +58,54 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef RBSTATS
+#define _POSIX_C_SOURCE 200112L   /* clock_gettime() */
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef RBTHREADS
+#include <pthread.h>
+#endif
+#ifdef RBSTATS
+#include <time.h>
+#endif
+#ifdef RBUSDT
+#include <sys/sdt.h>
+#endif
 
 #include "redblack.h"
 
+/*
+ * Instrumentation, both off unless built with the flag. RBSTATS times
+ * rbinsert(), rbfind() and rbdelete() into the histograms read with
+ * rbstats_get(). RBUSDT places static probes (provider redblack) at the
+ * entry and return of the main public calls for perf or bpftrace.
+ */
+#ifdef RBSTATS
+#define RBCLOCK(t)          unsigned long t = rbclock ()
+#define RBRECORD(op, t)     rbrecord ((op), (t))
+static unsigned long rbclock (void);
+static void rbrecord (enum rbstat, unsigned long);
+#else
+#define RBCLOCK(t)
+#define RBRECORD(op, t)
+#endif
+
+#ifdef RBUSDT
+#define RBPROBE1(name, a)       DTRACE_PROBE1(redblack, name, a)
+#define RBPROBE2(name, a, b)    DTRACE_PROBE2(redblack, name, a, b)
+#define RBPROBE3(name, a, b, c) DTRACE_PROBE3(redblack, name, a, b, c)
+#else
+#define RBPROBE1(name, a)
+#define RBPROBE2(name, a, b)
+#define RBPROBE3(name, a, b, c)
+#endif
+
+/* rbmin() without its probes, for the library's own calls */
+static rbnode *_rbmin (rbtree *);
+
 /*
  * Red-Black tree, see http://en.wikipedia.org/wiki/Red-black_tree
  *
@@ -82,6 +124,60 @@
  *     number of black nodes.
  */
 
+/* true if nodes carry a subtree augmentation to maintain */
+#define rbaugmented(t)    ((t)->high != NULL || (t)->combine != NULL)
+
+/* identity of the aggregate monoid, and rbaugment()'s scratch value (queries
+ * bring their own, see rbaggregate_range()) */
+#define rbidentity(t)     ((t)->aggbuf)
+#define rbscratch(t)      ((void *)((char *)(t)->aggbuf + (t)->aggsz))
+
+/* bytes behind node->aug: the subtree value, in a multiset followed by
+ * the node's own count of its key (see rbsetmultiset())
+ */
+#define rbaugsz(t)        ((t)->multiset ? 2 * sizeof (size_t) : (t)->aggsz)
+#define rbmcount(n)       (((size_t *)(n)->aug)[1])
+
+/*
+ * Recompute the augmentation of node from its own data and its children.
+ * In interval mode node->aug is the data with the largest high endpoint
+ * in the subtree rooted at node. In aggregate mode node->aug points to
+ * the combined value of the subtree, left to right.
+ */
+static void rbaugment (rbtree *tree, rbnode *node)
+{
+  void *max = node->data;
+
+  if (tree->combine) {
+    memcpy (node->aug, node->left != rbnil(tree) ? node->left->aug
+                                                 : rbidentity(tree),
+            tree->aggsz);
+    tree->value (node, rbscratch(tree));
+    tree->combine (node->aug, node->aug, rbscratch(tree));
+    if (node->right != rbnil(tree))
+      tree->combine (node->aug, node->aug, node->right->aug);
+    return;
+  }
+
+  if (node->left != rbnil(tree) &&
+      tree->epcmp (tree->high (node->left->aug), tree->high (max)) > 0)
+    max = node->left->aug;
+  if (node->right != rbnil(tree) &&
+      tree->epcmp (tree->high (node->right->aug), tree->high (max)) > 0)
+    max = node->right->aug;
+
+  node->aug = max;
+}
+
+/*
+ * Recompute the augmentation of node and each of its ancestors.
+ */
+static void rbaugment_path (rbtree *tree, rbnode *node)
+{
+  for (; node != rbroot(tree); node = node->parent)
+    rbaugment (tree, node);
+}
+
 /*
  * Perform a left rotation starting at node.
  */
@@ -104,6 +200,12 @@ static void rotate_left (rbtree *tree, rbnode *node)
 
   child->left = node;
   node->parent = child;
+
+  /* node is now below child, so recompute it first */
+  if (rbaugmented(tree)) {
+    rbaugment (tree, node);
+    rbaugment (tree, child);
+  }
 }
 
 /*
@@ -128,6 +230,11 @@ static void rotate_right (rbtree *tree, rbnode *node)
 
   child->right = node;
   node->parent = child;
+
+  if (rbaugmented(tree)) {
+    rbaugment (tree, node);
+    rbaugment (tree, child);
+  }
 }
 
 /*
@@ -196,6 +303,60 @@ static void rbrepair (rbtree *tree, rbnode *node)
   node->color = black;
 }
 
+/*
+ * In-order neighbours of node, or nil, dead nodes included.
+ */
+static rbnode *rbnext (rbtree *tree, rbnode *node)
+{
+  rbnode *succ;
+
+  if ((succ = node->right) != rbnil(tree)) {
+    while (succ->left != rbnil(tree))
+      succ = succ->left;
+  }
+  else {
+    /* No right child, move up until we find it or hit the root */
+    for (succ = node->parent; node == succ->right; succ = succ->parent)
+      node = succ;
+    if (succ == rbroot(tree))
+      succ = rbnil(tree);
+  }
+
+  return succ;
+}
+
+static rbnode *rbprev (rbtree *tree, rbnode *node)
+{
+  rbnode *prior;
+
+  if ((prior = node->left) != rbnil(tree)) {
+    while (prior->right != rbnil(tree))
+      prior = prior->right;
+  }
+  else {
+    /* No left child, move up until we find it or hit the root */
+    for (prior = node->parent; node == prior->left; prior = prior->parent)
+      node = prior;
+    if (prior == rbroot(tree))
+      prior = rbnil(tree);
+  }
+  return prior;
+}
+
+/*
+ * Compare data (whose key prefix is pfx) against node. When the tree has a
+ * prefix function, differing prefixes decide the order without touching
+ * node->data, compar is only called when the prefixes are equal.
+ */
+static int rbcompare (rbtree *tree, const void *data, unsigned long pfx,
+                      const rbnode *node)
+{
+  if (tree->prefix && pfx != node->prefix)
+    return pfx < node->prefix ? -1 : 1;
+
+  return tree->compar (data, node->data);
+}
+
 /*
  * Create a red black tree struct using the specified compare routine.
  * Allocates and returns the initialized (empty) tree.
@@ -210,6 +371,33 @@ rbtree *rbcreate (int (*compar)(const void *, const void*))
     return NULL;
   }
   tree->compar = compar;        /* assign comparison function pointer */
+  tree->prefix = NULL;          /* no inline key prefixes by default */
+  tree->count = tree->nuser = 0;
+
+  /* nodes are individually allocated until the tree is compacted */
+  tree->slabs = tree->oldslabs = NULL;
+  tree->slabfree = tree->cnext = NULL;
+  tree->relocate = NULL;
+  tree->rcookie = NULL;
+
+  tree->low = tree->high = NULL;
+  tree->epcmp = NULL;
+
+  tree->aggsz = 0;
+  tree->nodesz = sizeof (rbnode);
+  tree->combine = NULL;
+  tree->value = NULL;
+  tree->aggbuf = NULL;
+
+  tree->capacity = 0;           /* unbounded */
+  tree->bound = NULL;
+  tree->evict = NULL;
+
+  tree->ndead = 0;              /* nothing awaits a purge */
+  tree->purgepct = 0;
+  tree->reap = NULL;
+
+  tree->multiset = 0;           /* duplicates are rejected */
 
   /*
    * Use a self-referencing sentinel node called nil to avoid the need to
@@ -218,6 +406,9 @@ rbtree *rbcreate (int (*compar)(const void *, const void*))
   tree->nil.left = tree->nil.right = tree->nil.parent = &tree->nil;
   tree->nil.color = black;
   tree->nil.data = NULL;
+  tree->nil.flags = 0;
+  tree->nil.prefix = 0;
+  tree->nil.aug = NULL;
 
   /*
    * Similarly, a fake root node eliminates worry about splitting the root.
@@ -225,60 +416,68 @@ rbtree *rbcreate (int (*compar)(const void *, const void*))
   tree->root.left = tree->root.right = tree->root.parent = &tree->nil;
   tree->root.color = black;
   tree->root.data = NULL;
+  tree->root.flags = 0;
+  tree->root.prefix = 0;
+  tree->root.aug = NULL;
 
   return tree;
 }
 
 /*
- * Insert data into a redblack tree. If typesz is non-zere,
- * then typesz bytes are allocated for data and data copied into
- * tree. (tree allocates). If typesz is zero, the data pointer is
- * assigned. (user allocates).
- * Returns a NULL pointer on success.  If a node matching "data"
- * already exists, a pointer to the existant node is returned.
+ * Have the tree keep an inline key prefix in each node. prefix must map
+ * data to an unsigned long that preserves the order given by compar, i.e.
+ * prefix(a) < prefix(b) implies compar(a, b) < 0 (equal prefixes say
+ * nothing). Lookups and inserts then compare prefixes first and only
+ * dereference node->data when the prefixes tie. Must be set while the tree
+ * is empty, returns 0 on success, -1 otherwise.
  */
-rbnode *rbinsert (rbtree *tree, void *data, size_t typesz)
+int rbsetprefix (rbtree *tree, unsigned long (*prefix)(const void *))
 {
-  rbnode *node    = rbfirst(tree);
-  rbnode *parent  = rbroot(tree);
-  int res;
+  if (tree->count)
+    return -1;
 
-  /* Find correct insertion point. */
-  while (node != rbnil(tree)) {
-    parent = node;
-    if ((res = tree->compar(data, node->data)) == 0) {
-      return node;
-    }
-    node = res < 0 ? node->left : node->right;
-  }
+  tree->prefix = prefix;
 
-  /* allocate/validate new node */
-  if (!(node = malloc (sizeof *node))) {
-    perror ("malloc-node-rbinsert()");
-    return rberr(tree);
-  }
+  return 0;
+}
 
-  /* typesz controls whether storage is allocated for data and data copied, or
-   * if user allocates for data and the pointer assigned. typesz > 0, then
-   * tree allocates, otherwise user allocates. free of data is controlled by
-   * whether the return of rbdestroy is passed to free by the user.
-   */
-  if (typesz != 0) {
-    /* allocate/validate storage for node->data of typesz bytes */
-    if (!(node->data = malloc (typesz))) {
-      perror ("malloc-node->data-rbinsert()");
-      return rberr(tree);
-    }
-    /* copy data */
-    memcpy (node->data, data, typesz);
-  }
-  else {
-    node->data = data;  /* assign pointer */
+/*
+ * Order-preserving prefix for data pointing to a nul-terminated string:
+ * the first sizeof(unsigned long) bytes packed most significant first
+ * and zero-padded, suitable for rbsetprefix() with strcmp() ordering.
+ */
+unsigned long rbprefix_str (const void *data)
+{
+  const unsigned char *p = data;
+  unsigned long pfx = 0;
+  size_t i;
+
+  for (i = 0; i < sizeof pfx; i++) {
+    pfx <<= 8;
+    if (*p)
+      pfx |= *p++;
   }
+
+  return pfx;
+}
+
+/*
+ * Link a caller-allocated node into the tree below parent and rebalance.
+ * parent and res are the last node visited and the result of the last
+ * comparison made while descending to the insertion point, the node is
+ * attached as the left child of parent if res < 0, otherwise as the right
+ * child. The node->data member must be set by the caller. This is the
+ * second half of rbinsert() for callers that do their own descent.
+ */
+void rblink (rbtree *tree, rbnode *parent, rbnode *node, int res)
+{
   node->left = node->right = rbnil(tree);
   node->parent = parent;
+  tree->count++;
+  if (node->flags & rbuser)
+    tree->nuser++;
 
-  if (parent == rbroot(tree) || tree->compar(data, parent->data) < 0) {
+  if (parent == rbroot(tree) || res < 0) {
     parent->left = node;
   }
   else {
@@ -286,6 +485,10 @@ rbnode *rbinsert (rbtree *tree, void *data, size_t typesz)
   }
   node->color = red;
 
+  /* new data changes the path above it, rotations maintain the rest */
+  if (rbaugmented(tree))
+    rbaugment_path (tree, node);
+
   /*
    * If the parent node is black we are all set, if it is red we have
    * the following possible cases to deal with.  We iterate through
@@ -350,133 +553,462 @@ rbnode *rbinsert (rbtree *tree, void *data, size_t typesz)
   }
 
   rbfirst(tree)->color = black;	/* first node is always black */
-
-  return NULL;
 }
 
 /*
- * Look for a node matching key in tree.
- * Returns a pointer to the node if found, else NULL.
+ * Release an unlinked node whose flags were flags: heap nodes are freed,
+ * slab slots go on the free list for rbinsert() to reuse, except while a
+ * compaction is emptying the slabs. Caller-owned nodes are left alone.
  */
-rbnode *rbfind (rbtree *tree, void *key)
+static void rbfree_node (rbtree *tree, rbnode *node, unsigned flags)
 {
-  rbnode *node = rbfirst(tree);
-  int res;
+  if (flags & rbuser)
+    return;
 
-  while (node != rbnil(tree)) {
-    if ((res = tree->compar (key, node->data)) == 0)
-      return node;
-    node = res < 0 ? node->left : node->right;
+  if (!(flags & rbinslab)) {
+    free (node);
+  }
+  else if (!tree->cnext) {
+    node->parent = tree->slabfree;
+    tree->slabfree = node;
   }
-  return NULL;
 }
 
 /*
- * rbmin - find the node with the minimum key value in tree.
+ * Dispose of an unlinked node as a purge does: its data goes to the
+ * reap destructor, the node is released unless caller owned.
  */
-rbnode *rbmin (rbtree *tree)
+static void rbreap (rbtree *tree, rbnode *node)
 {
-  rbnode *iter = tree->root.left;
-
-  while (iter->left != rbnil (tree))
-    iter = iter-> left;
+  /* reap may free the container holding a caller-owned node */
+  unsigned flags = node->flags;
 
-  return iter;
+  if (tree->reap)
+    tree->reap (node->data);
+  rbfree_node (tree, node, flags);
 }
 
 /*
- * rbmax - find the node with the maximum key value in tree.
+ * Bring a dead tree-owned node matching data back to life in place.
+ * Internal storage is reused (typesz must match), external data replaces
+ * the old pointer, which is passed to reap. Returns NULL as rbinsert()
+ * does.
  */
-rbnode *rbmax (rbtree *tree)
+static rbnode *rbrevive (rbtree *tree, rbnode *node, void *data,
+                         size_t typesz)
 {
-  rbnode *iter = tree->root.left;
-
-  while (iter->right != rbnil (tree))
-    iter = iter-> right;
+  if (typesz != 0) {
+    memcpy (node->data, data, typesz);
+  }
+  else {
+    if (tree->reap)
+      tree->reap (node->data);
+    node->data = data;
+  }
+  node->flags &= ~rbdead;
+  tree->ndead--;
 
-  return iter;
+  return NULL;
 }
 
 /*
- * Returns the successor of node, or nil if there is none.
+ * A duplicate of node's key was inserted, count it in a multiset. Returns
+ * node, as rbinsert() does for a duplicate.
  */
-rbnode *rbsuccessor (rbtree *tree, rbnode *node)
+static rbnode *rbrepeat (rbtree *tree, rbnode *node)
 {
-  rbnode *succ;
-
-  if ((succ = node->right) != rbnil(tree)) {
-    while (succ->left != rbnil(tree))
-      succ = succ->left;
-  }
-  else {
-    /* No right child, move up until we find it or hit the root */
-    for (succ = node->parent; node == succ->right; succ = succ->parent)
-      node = succ;
-    if (succ == rbroot(tree))
-      succ = rbnil(tree);
+  if (tree->multiset) {
+    rbmcount(node)++;
+    rbaugment_path (tree, node);
   }
 
-  return succ;
+  return node;
 }
 
 /*
- * Returns the prior node, or nil if there is none.
+ * Insert data into a redblack tree. If typesz is non-zere,
+ * then typesz bytes are allocated for data and data copied into
+ * tree. (tree allocates). If typesz is zero, the data pointer is
+ * assigned. (user allocates).
+ * Returns a NULL pointer on success.  If a node matching "data"
+ * already exists, a pointer to the existant node is returned. A full
+ * bounded tree (see rbsetcapacity()) returns rbnil(tree) for data below
+ * its minimum.
  */
-rbnode *rbprior (rbtree *tree, rbnode *node)
+static rbnode *_rbinsert (rbtree *tree, void *data, size_t typesz)
 {
-  rbnode *prior;
+  rbnode *node, *parent, *victim = NULL;
+  unsigned long pfx = tree->prefix ? tree->prefix (data) : 0;
+  int res = 0;
 
-  if ((prior = node->left) != rbnil(tree)) {
-    while (prior->right != rbnil(tree))
-      prior = prior->right;
+  /* a full bounded tree turns away anything not above its minimum with a
+   * single comparison, otherwise the minimum makes room for data.
+   */
+  if (tree->capacity && tree->count >= tree->capacity) {
+    if (!tree->bound)
+      tree->bound = _rbmin (tree);
+    if ((res = rbcompare (tree, data, pfx, tree->bound)) <= 0)
+      return res == 0 ? rbrepeat (tree, tree->bound) : rbnil(tree);
+    victim = tree->bound;
+    rbunlink (tree, victim);
+  }
+
+  node = rbfirst(tree);
+  parent = rbroot(tree);
+
+  /* Find correct insertion point. */
+  while (node != rbnil(tree)) {
+    parent = node;
+    if ((res = rbcompare (tree, data, pfx, node)) == 0) {
+      if (node->flags & rbuser && node->flags & rbdead) {
+        /* the caller's container may be gone, a tree node takes over */
+        rbunlink (tree, node);
+        rbreap (tree, node);
+        return _rbinsert (tree, data, typesz);
+      }
+      if (node->flags & rbdead)
+        return rbrevive (tree, node, data, typesz);
+      if (victim) {
+        /* put the minimum back, it goes at the far left */
+        for (parent = rbroot(tree); parent->left != rbnil(tree); )
+          parent = parent->left;
+        rblink (tree, parent, victim, -1);
+        tree->bound = victim;
+      }
+      return rbrepeat (tree, node);
+    }
+    node = res < 0 ? node->left : node->right;
+  }
+
+  if (victim && !(victim->flags & rbuser)) {
+    /* reuse the evicted node, and its data storage with internal storage */
+    node = victim;
+    if (typesz != 0) {
+      memcpy (node->data, data, typesz);
+    }
+    else {
+      if (tree->evict)
+        tree->evict (node->data);
+      node->data = data;
+    }
+    node->prefix = pfx;
+    if (tree->multiset)
+      rbmcount(node) = 1;
+    rblink (tree, parent, node, res);
+    tree->bound = _rbmin (tree);
+
+    return NULL;
+  }
+  if (victim && tree->evict)
+    tree->evict (victim->data);   /* caller-owned node, only data goes */
+
+  /* allocate/validate new node, with its aggregate value if any, taking
+   * a slab slot freed since the last compaction if there is one.
+   */
+  if ((node = tree->slabfree)) {
+    tree->slabfree = node->parent;
+    node->flags = rbinslab;
+  }
+  else if ((node = malloc (tree->nodesz))) {
+    node->flags = 0;
   }
   else {
-    /* No right child, move up until we find it or hit the root */
-    for (prior = node->parent; node == prior->left; prior = prior->parent)
-      node = prior;
-    if (prior == rbroot(tree))
-      prior = rbnil(tree);
+    perror ("malloc-node-rbinsert()");
+    return rberr(tree);
   }
-  return prior;
+  node->aug = tree->aggsz ? node + 1 : NULL;
+
+  /* typesz controls whether storage is allocated for data and data copied, or
+   * if user allocates for data and the pointer assigned. typesz > 0, then
+   * tree allocates, otherwise user allocates. free of data is controlled by
+   * whether the return of rbdestroy is passed to free by the user.
+   */
+  if (typesz != 0) {
+    /* allocate/validate storage for node->data of typesz bytes */
+    if (!(node->data = malloc (typesz))) {
+      perror ("malloc-node->data-rbinsert()");
+      rbfree_node (tree, node, node->flags);
+      return rberr(tree);
+    }
+    /* copy data */
+    memcpy (node->data, data, typesz);
+  }
+  else {
+    node->data = data;  /* assign pointer */
+  }
+  node->prefix = pfx;
+  if (tree->multiset)
+    rbmcount(node) = 1;
+  rblink (tree, parent, node, res);
+
+  if (tree->capacity && tree->count == tree->capacity)
+    tree->bound = _rbmin (tree);
+
+  return NULL;
+}
+
+rbnode *rbinsert (rbtree *tree, void *data, size_t typesz)
+{
+  rbnode *ret;
+  RBCLOCK(t0);
+
+  RBPROBE2(insert_entry, tree, data);
+  ret = _rbinsert (tree, data, typesz);
+  RBPROBE2(insert_return, tree, ret);
+  RBRECORD(rbstat_insert, t0);
+
+  return ret;
 }
 
 /*
- * Call func() for each node, passing it the node data and a cookie;
- * If func() returns non-zero for a node, the traversal stops and the
- * error value is returned.  Returns 0 on successful traversal.
+ * Bound the tree to capacity nodes (0 for no bound), for keeping the
+ * top-k data of a stream. Once the tree is full rbinsert() compares data
+ * against the cached minimum only: data below it is rejected (rbinsert()
+ * returns rbnil(tree)), anything above it replaces the minimum, reusing
+ * the minimum's node and, with internal storage, its data storage (so all
+ * inserts must use the same typesz). With external storage the evicted
+ * data is passed to evict, if not NULL. Returns 0 on success, -1 if the
+ * tree already holds more than capacity nodes.
  */
-int rbapply_node (rbtree *tree, rbnode *node,
-                  int (*func)(void *, void *), void *cookie,
-                  enum rbtraversal order)
+int rbsetcapacity (rbtree *tree, size_t capacity, void (*evict)(void *))
 {
-  int error;
-
-  if (node != rbnil(tree)) {
-    if (order == preorder) {
-      if ((error = func(node->data, cookie)) != 0)
-        return error;
-    }
+  rbpurge (tree);     /* a bounded tree holds no dead nodes */
 
-    if ((error = rbapply_node(tree, node->left, func, cookie, order)) != 0)
-      return error;
+  if (capacity && tree->count > capacity)
+    return -1;
 
-    if (order == inorder) {
-      if ((error = func(node->data, cookie)) != 0)
-        return error;
-    }
-    if ((error = rbapply_node(tree, node->right, func, cookie, order)) != 0)
-      return error;
+  tree->capacity = capacity;
+  tree->evict = evict;
+  tree->bound = capacity && tree->count == capacity ? _rbmin (tree) : NULL;
 
-    if (order == postorder) {
-      if ((error = func(node->data, cookie)) != 0)
-        return error;
-    }
-  }
   return 0;
 }
 
 /*
- * Call func() for each node, passing it the node and a cookie;
+ * Insert a caller-owned node, typically an rbnode embedded in the
+ * caller's struct (intrusive storage). node->data must be set before the
+ * call, usually to the containing struct, and is passed to compar as with
+ * rbinsert(). Nothing is allocated, and the node is never freed by the
+ * tree: rbdelete() only unlinks it and rbdestroy() only calls destroy on
+ * its data. Use rbentry() to get from the node back to the container.
+ * Returns NULL on success, or the existing node matching node->data. A
+ * bounded tree (see rbsetcapacity()) takes no caller-owned nodes and
+ * returns rbnil(tree).
+ */
+static rbnode *_rbinsert_node (rbtree *tree, rbnode *node)
+{
+  rbnode *iter    = rbfirst(tree);
+  rbnode *parent  = rbroot(tree);
+  unsigned long pfx;
+  int res = 0;
+
+  /* it would grow the tree past capacity and the cached minimum */
+  if (tree->capacity)
+    return rbnil(tree);
+
+  pfx = tree->prefix ? tree->prefix (node->data) : 0;
+
+  while (iter != rbnil(tree)) {
+    parent = iter;
+    if ((res = rbcompare (tree, node->data, pfx, iter)) == 0) {
+      if (!(iter->flags & rbdead))
+        return rbrepeat (tree, iter);
+      /* a dead node makes way for the caller's node */
+      rbunlink (tree, iter);
+      rbreap (tree, iter);
+      return _rbinsert_node (tree, node);
+    }
+    iter = res < 0 ? iter->left : iter->right;
+  }
+
+  node->flags = rbuser;
+  node->prefix = pfx;
+  if (tree->multiset)
+    rbmcount(node) = 1;
+  rblink (tree, parent, node, res);
+
+  return NULL;
+}
+
+rbnode *rbinsert_node (rbtree *tree, rbnode *node)
+{
+  rbnode *ret;
+  RBCLOCK(t0);
+
+  RBPROBE2(insert_node_entry, tree, node);
+  ret = _rbinsert_node (tree, node);
+  RBPROBE2(insert_node_return, tree, ret);
+  RBRECORD(rbstat_insert_node, t0);
+
+  return ret;
+}
+
+/*
+ * Look for a node matching key in tree.
+ * Returns a pointer to the node if found, else NULL.
+ */
+static rbnode *_rbfind (rbtree *tree, void *key)
+{
+  rbnode *node = rbfirst(tree);
+  unsigned long pfx = tree->prefix ? tree->prefix (key) : 0;
+  int res;
+
+  while (node != rbnil(tree)) {
+    if ((res = rbcompare (tree, key, pfx, node)) == 0)
+      return node->flags & rbdead ? NULL : node;
+    node = res < 0 ? node->left : node->right;
+  }
+  return NULL;
+}
+
+rbnode *rbfind (rbtree *tree, void *key)
+{
+  rbnode *ret;
+  RBCLOCK(t0);
+
+  RBPROBE2(find_entry, tree, key);
+  ret = _rbfind (tree, key);
+  RBPROBE2(find_return, tree, ret);
+  RBRECORD(rbstat_find, t0);
+
+  return ret;
+}
+
+/*
+ * rbmin - find the node with the minimum key value in tree.
+ */
+static rbnode *_rbmin (rbtree *tree)
+{
+  rbnode *iter = tree->root.left;
+
+  while (iter->left != rbnil (tree))
+    iter = iter-> left;
+
+  while (iter->flags & rbdead)
+    iter = rbnext (tree, iter);
+
+  return iter;
+}
+
+rbnode *rbmin (rbtree *tree)
+{
+  rbnode *ret;
+
+  RBPROBE1(min_entry, tree);
+  ret = _rbmin (tree);
+  RBPROBE2(min_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ * rbmax - find the node with the maximum key value in tree.
+ */
+static rbnode *_rbmax (rbtree *tree)
+{
+  rbnode *iter = tree->root.left;
+
+  while (iter->right != rbnil (tree))
+    iter = iter-> right;
+
+  while (iter->flags & rbdead)
+    iter = rbprev (tree, iter);
+
+  return iter;
+}
+
+rbnode *rbmax (rbtree *tree)
+{
+  rbnode *ret;
+
+  RBPROBE1(max_entry, tree);
+  ret = _rbmax (tree);
+  RBPROBE2(max_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ * Returns the successor of node, or nil if there is none.
+ */
+rbnode *rbsuccessor (rbtree *tree, rbnode *node)
+{
+  RBPROBE2(successor_entry, tree, node);
+  do
+    node = rbnext (tree, node);
+  while (node->flags & rbdead);
+  RBPROBE2(successor_return, tree, node);
+
+  return node;
+}
+
+/*
+ * Returns the prior node, or nil if there is none.
+ */
+rbnode *rbprior (rbtree *tree, rbnode *node)
+{
+  RBPROBE2(prior_entry, tree, node);
+  do
+    node = rbprev (tree, node);
+  while (node->flags & rbdead);
+  RBPROBE2(prior_return, tree, node);
+
+  return node;
+}
+
+/*
+ * Call func() for each node, passing it the node data and a cookie;
+ * If func() returns non-zero for a node, the traversal stops and the
+ * error value is returned.  Returns 0 on successful traversal.
+ */
+static int _rbapply_node (rbtree *tree, rbnode *node,
+                          int (*func)(void *, void *), void *cookie,
+                          enum rbtraversal order)
+{
+  int error;
+
+  if (node != rbnil(tree)) {
+    if (order == preorder) {
+      if (!(node->flags & rbdead) &&
+          (error = func(node->data, cookie)) != 0)
+        return error;
+    }
+
+    if ((error = _rbapply_node(tree, node->left, func, cookie, order)) != 0)
+      return error;
+
+    if (order == inorder) {
+      if (!(node->flags & rbdead) &&
+          (error = func(node->data, cookie)) != 0)
+        return error;
+    }
+    if ((error = _rbapply_node(tree, node->right, func, cookie, order)) != 0)
+      return error;
+
+    if (order == postorder) {
+      if (!(node->flags & rbdead) &&
+          (error = func(node->data, cookie)) != 0)
+        return error;
+    }
+  }
+  return 0;
+}
+
+int rbapply_node (rbtree *tree, rbnode *node,
+                  int (*func)(void *, void *), void *cookie,
+                  enum rbtraversal order)
+{
+  int ret;
+
+  RBPROBE2(apply_entry, tree, node);
+  ret = _rbapply_node (tree, node, func, cookie, order);
+  RBPROBE2(apply_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ * Call func() for each node, passing it the node and a cookie;
  * If func() returns non-zero for a node, the traversal stops and the
  * error value is returned.  Returns 0 on successful traversal.
  * cookie is value of users choosing pass to function as pointer.
@@ -489,21 +1021,21 @@ int rbtraverse (rbtree *tree, rbnode *node,
 
   if (node != rbnil(tree)) {
     if (order == preorder)
-      if ((error = func (node, cookie)) != 0)
+      if (!(node->flags & rbdead) && (error = func (node, cookie)) != 0)
         return error;
 
     if ((error = rbtraverse (tree, node->left, func, cookie, order)) != 0)
       return error;
 
     if (order == inorder)
-      if ((error = func (node, cookie)) != 0)
+      if (!(node->flags & rbdead) && (error = func (node, cookie)) != 0)
         return error;
 
     if ((error = rbtraverse (tree, node->right, func, cookie, order)) != 0)
       return error;
 
     if (order == postorder)
-      if ((error = func (node, cookie)) != 0)
+      if (!(node->flags & rbdead) && (error = func (node, cookie)) != 0)
         return error;
   }
 
@@ -511,13 +1043,18 @@ int rbtraverse (rbtree *tree, rbnode *node,
 }
 
 /*
- * Replace a node with a new node, update surrounding pointers.
+ * Replace a node with a new node, update surrounding pointers. The
+ * victim is returned for the caller to dispose of, so a victim living in
+ * a compaction slab (rbinslab) cannot be replaced and NULL is returned.
+ * Nor can nodes of an aggregate or multiset tree, whose subtree values
+ * live in storage that goes with the victim.
  */
 rbnode *rbreplace (rbtree *tree, rbnode *victim, rbnode *new)
 {
   rbnode *root = NULL;
 
-  if (!victim || !new) return NULL;
+  if (!victim || !new || (victim->flags & rbinslab) || tree->combine)
+    return NULL;
 
   root = rbroot(tree);
 
@@ -538,81 +1075,1797 @@ rbnode *rbreplace (rbtree *tree, rbnode *victim, rbnode *new)
   if (victim->right)
     victim->right->parent = new;
 
-  /* copy pointers/color from victim to replacement */
+  /* copy pointers/color from victim to replacement, which is owned as
+   * the victim was.
+   */
   *new = *victim;
 
+  if (tree->cnext == victim)
+    tree->cnext = new;
+  if (tree->bound == victim)
+    tree->bound = new;
+
   return victim;
 }
 
 /*
- * Recursive portion of rbdestroy().
+ * Interval mode.
+ *
+ * The data in the tree are intervals, ordered by compar on their low
+ * endpoint (compar must break ties between equal low endpoints, e.g. on
+ * the high endpoint, since keys are unique). low() and high() return a
+ * pointer to the endpoints of a data item and epcmp() compares two
+ * endpoints. Each node keeps in node->aug the data with the largest high
+ * endpoint in its subtree, which lets overlap queries skip every subtree
+ * that ends before the query starts. Intervals are closed: [lo, hi].
+ *
+ * Interval and aggregate mode both use node->aug and cannot be combined.
+ * Must be set while the tree is empty, returns 0 on success, -1 otherwise.
  */
-static void _rbdestroy (rbtree *tree, rbnode *node, void (*destroy)(void *))
+int rbsetinterval (rbtree *tree, const void *(*low)(const void *),
+                   const void *(*high)(const void *),
+                   int (*epcmp)(const void *, const void *))
 {
-  if (node != rbnil(tree)) {
+  if (tree->count || tree->combine)
+    return -1;
 
-    _rbdestroy(tree, node->left, destroy);
-    _rbdestroy(tree, node->right, destroy);
+  tree->low = low;
+  tree->high = high;
+  tree->epcmp = epcmp;
 
-    if (destroy != NULL)
-      destroy (node->data);
+  return 0;
+}
 
-    free (node);
+/*
+ * Recursive portion of rbinterval_overlaps().
+ */
+static int _rbinterval_overlaps (rbtree *tree, rbnode *node,
+                                 const void *lo, const void *hi,
+                                 int (*func)(void *, void *), void *cookie)
+{
+  int error;
+
+  while (node != rbnil(tree)) {
+    /* nothing in this subtree reaches lo */
+    if (tree->epcmp (tree->high (node->aug), lo) < 0)
+      return 0;
+
+    if ((error = _rbinterval_overlaps (tree, node->left, lo, hi,
+                                       func, cookie)) != 0)
+      return error;
+
+    /* node and everything to its right start after hi */
+    if (tree->epcmp (tree->low (node->data), hi) > 0)
+      return 0;
+
+    if (tree->epcmp (lo, tree->high (node->data)) <= 0)
+      if ((error = func (node->data, cookie)) != 0)
+        return error;
+
+    node = node->right;
   }
+
+  return 0;
 }
 
 /*
- * Destroy the specified tree, calling the destructor destroy
- * for each node and then freeing the tree itself.
+ * Call func() in order for the data of every interval overlapping
+ * [lo, hi], passing it the data and a cookie. If func() returns non-zero
+ * the query stops and the error value is returned. Returns 0 otherwise.
+ * Runs in O(log n + k) for k overlapping intervals.
  */
-void rbdestroy (rbtree *tree, void (*destroy)(void *))
+int rbinterval_overlaps (rbtree *tree, const void *lo, const void *hi,
+                         int (*func)(void *, void *), void *cookie)
 {
-  _rbdestroy (tree, rbfirst(tree), destroy);
+  int ret;
 
-  free (tree);
+  RBPROBE3(interval_overlaps_entry, tree, lo, hi);
+  ret = _rbinterval_overlaps (tree, rbfirst(tree), lo, hi, func, cookie);
+  RBPROBE2(interval_overlaps_return, tree, ret);
+
+  return ret;
 }
 
 /*
- * Delete node 'z' from the tree and return its data pointer.
+ * Returns a node whose interval overlaps [lo, hi], or NULL if there is
+ * none, in O(log n).
  */
-void *rbdelete (rbtree *tree, rbnode *z)
+static rbnode *_rbinterval_any (rbtree *tree, const void *lo, const void *hi)
 {
-  rbnode *x, *y;
-  void *data = z->data;
+  rbnode *node = rbfirst(tree);
 
-  if (z->left == rbnil(tree) || z->right == rbnil(tree))
-    y = z;
-  else
-    y = rbsuccessor(tree, z);
+  while (node != rbnil(tree)) {
+    if (tree->epcmp (tree->low (node->data), hi) <= 0 &&
+        tree->epcmp (lo, tree->high (node->data)) <= 0)
+      return node;
 
-  x = (y->left == rbnil(tree)) ? y->right : y->left;
+    /* if anything on the left reaches lo, an overlap (if any) is there */
+    if (node->left != rbnil(tree) &&
+        tree->epcmp (tree->high (node->left->aug), lo) >= 0)
+      node = node->left;
+    else
+      node = node->right;
+  }
 
-  if ((x->parent = y->parent) == rbroot(tree)) {
-    rbfirst(tree) = x;
+  return NULL;
+}
+
+rbnode *rbinterval_any (rbtree *tree, const void *lo, const void *hi)
+{
+  rbnode *ret;
+
+  RBPROBE3(interval_any_entry, tree, lo, hi);
+  ret = _rbinterval_any (tree, lo, hi);
+  RBPROBE2(interval_any_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ * Compaction.
+ *
+ * After long insert/delete churn the nodes of a tree end up scattered
+ * across the heap. Compaction relocates every tree-allocated node into one
+ * contiguous slab in in-order (key) order, so in-order scans walk memory
+ * sequentially and the upper levels of a lookup share cache lines and
+ * pages. Nodes added with rbinsert_node() belong to the caller and are
+ * never moved.
+ *
+ * Relocation changes node addresses. Anything outside the tree holding an
+ * rbnode pointer must either not hold it across rbcompact()/rbcompact_step()
+ * or register a callback with rbsetrelocate(), which is called with the old
+ * and new address of every node moved. Data pointers are unaffected.
+ */
+
+/*
+ * Slab header, the nodes follow it in the same allocation.
+ */
+typedef struct rbslab {
+  struct rbslab *next;
+  size_t n,           /* nodes in slab */
+         used;        /* nodes handed out */
+} rbslab;
+
+/* node i of a slab, nodes are tree->nodesz bytes apart */
+#define rbslab_node(t, s, i) \
+        ((rbnode *)((char *)((s) + 1) + (i) * (t)->nodesz))
+
+/*
+ * Free a list of slabs.
+ */
+static void rbslab_free (rbslab *slab)
+{
+  rbslab *next;
+
+  for (; slab; slab = next) {
+    next = slab->next;
+    free (slab);
   }
-  else {
-    if (y == y->parent->left)
-      y->parent->left = x;
-    else
-      y->parent->right = x;
+}
+
+/*
+ * Register func to be called as func(old, new, cookie) for every node
+ * relocated by compaction. Returns 0.
+ */
+int rbsetrelocate (rbtree *tree, void (*func)(rbnode *, rbnode *, void *),
+                   void *cookie)
+{
+  tree->relocate = func;
+  tree->rcookie = cookie;
+
+  return 0;
+}
+
+/*
+ * Move node to dst, which is either a free slab slot (slab != 0) or a
+ * newly allocated node, and fix up the links that point to it.
+ */
+static void rbmove (rbtree *tree, rbnode *node, rbnode *dst, int slab)
+{
+  *dst = *node;
+  dst->flags = slab ? node->flags | rbinslab : node->flags & ~rbinslab;
+  if (tree->aggsz) {
+    dst->aug = dst + 1;
+    memcpy (dst->aug, node->aug, rbaugsz(tree));
   }
 
-  if (y->color == black)
-    rbrepair(tree, x);
+  if (node == node->parent->left)
+    node->parent->left = dst;
+  else
+    node->parent->right = dst;
+  if (dst->left != rbnil(tree))
+    dst->left->parent = dst;
+  if (dst->right != rbnil(tree))
+    dst->right->parent = dst;
+
+  if (tree->bound == node)
+    tree->bound = dst;
+  if (tree->relocate)
+    tree->relocate (node, dst, tree->rcookie);
+
+  if (!(node->flags & rbinslab))
+    free (node);
+}
 
-  if (y != z) {
-    y->left = z->left;
-    y->right = z->right;
-    y->parent = z->parent;
-    y->color = z->color;
-    z->left->parent = z->right->parent = y;
-    if (z == z->parent->left)
-      z->parent->left = y;
-    else
-      z->parent->right = y;
+/*
+ * Relocate up to budget nodes into in-order position in a fresh slab,
+ * starting a compaction if none is in progress. Nodes inserted while a
+ * compaction is in progress are moved too if they are ahead of the cursor,
+ * once the slab is full they are moved to individually allocated nodes so
+ * every node leaves the old slabs, which are freed when the pass ends.
+ * Returns 0 when the compaction is complete, 1 if more steps are needed,
+ * or -1 on allocation failure (the tree is intact, the pass can be retried).
+ */
+int rbcompact_step (rbtree *tree, size_t budget)
+{
+  rbslab *slab;
+  rbnode *node, *dst;
+  size_t n;
+
+  if (!tree->cnext) {
+    /* caller-owned nodes stay where they are */
+    n = tree->count - tree->nuser;
+    if (!(slab = malloc (sizeof *slab + n * tree->nodesz))) {
+      perror ("malloc-slab-rbcompact_step()");
+      return -1;
+    }
+    slab->n = n;
+    slab->used = 0;
+
+    /* every node now in a slab will move, so all current slabs retire
+     * along with their free slots.
+     */
+    tree->oldslabs = tree->slabs;
+    tree->slabs = slab;
+    tree->slabfree = NULL;
+    slab->next = NULL;
+
+    for (node = rbfirst(tree); node->left != rbnil(tree); )
+      node = node->left;
+    tree->cnext = node;
   }
-  free(z);
+  slab = tree->slabs;
 
-  return data;
+  while (budget-- && (node = tree->cnext) != rbnil(tree)) {
+    if (node->flags & rbuser) {
+      tree->cnext = rbnext (tree, node);
+      continue;
+    }
+    if (slab->used < slab->n) {
+      dst = rbslab_node(tree, slab, slab->used);
+      slab->used++;
+      rbmove (tree, node, dst, 1);
+    }
+    else {
+      if (!(dst = malloc (tree->nodesz))) {
+        perror ("malloc-node-rbcompact_step()");
+        return -1;
+      }
+      rbmove (tree, node, dst, 0);
+    }
+    tree->cnext = rbnext (tree, dst);
+  }
+
+  if (tree->cnext != rbnil(tree))
+    return 1;
+
+  /* pass complete, nothing is left in the retired slabs, and slots
+   * nodes deleted during the pass left unused are free for inserts.
+   */
+  rbslab_free (tree->oldslabs);
+  tree->oldslabs = NULL;
+  tree->cnext = NULL;
+  for (n = slab->used; n < slab->n; n++) {
+    node = rbslab_node(tree, slab, n);
+    node->parent = tree->slabfree;
+    tree->slabfree = node;
+  }
+  slab->used = slab->n;
+
+  return 0;
+}
+
+/*
+ * Compact the whole tree in one pass, see rbcompact_step().
+ * Returns 0 on success, -1 on allocation failure.
+ */
+int rbcompact (rbtree *tree)
+{
+  return rbcompact_step (tree, (size_t)-1) < 0 ? -1 : 0;
 }
 
+/*
+ * Aggregate mode.
+ *
+ * Each node keeps the combined value of its whole subtree, so the value
+ * over any key range can be put together from O(log n) subtree values
+ * instead of visiting every node in the range. The values form a monoid:
+ *
+ *   aggsz     - size in bytes of a value
+ *   identity  - the value of an empty range (copied by the tree)
+ *   combine   - combine (out, a, b) stores a . b in out, out may be a; it
+ *               must be associative, it need not be commutative (values
+ *               are always combined in key order)
+ *   value     - value (node, out) stores the value of a single node in
+ *               out, usually computed from node->data
+ *
+ * e.g. a sum of sizes: aggsz = sizeof (size_t), identity 0, combine adds,
+ * value stores the size held in node->data.
+ *
+ * Tree-allocated nodes carry their value storage after the node, nodes
+ * added with rbinsert_node() must have node->aug pointing at aggsz bytes
+ * of storage owned by the caller. Interval and aggregate mode both use
+ * node->aug and cannot be combined. Updates and queries share a scratch
+ * value in the tree, so they must not run concurrently on the same tree.
+ * Must be set while the tree is empty, returns 0 on success, -1 otherwise.
+ */
+int rbsetaggregate (rbtree *tree, size_t aggsz, const void *identity,
+                    void (*combine)(void *, const void *, const void *),
+                    void (*value)(const rbnode *, void *))
+{
+  void *buf;
+
+  if (tree->count || tree->high || tree->multiset || aggsz == 0)
+    return -1;
+
+  /* identity and scratch value */
+  if (!(buf = malloc (2 * aggsz))) {
+    perror ("malloc-aggbuf-rbsetaggregate()");
+    return -1;
+  }
+  memcpy (buf, identity, aggsz);
+
+  /* slabs left from before the tree emptied hold no live nodes and have
+   * the old node size, drop them.
+   */
+  rbslab_free (tree->slabs);
+  rbslab_free (tree->oldslabs);
+  tree->slabs = tree->oldslabs = NULL;
+  tree->slabfree = tree->cnext = NULL;
+
+  free (tree->aggbuf);
+  tree->aggbuf = buf;
+  tree->aggsz = aggsz;
+
+  /* keep the value behind each node aligned like the node itself */
+  tree->nodesz = sizeof (rbnode) +
+                 (aggsz + sizeof (void *) - 1) / sizeof (void *) *
+                 sizeof (void *);
+  tree->combine = combine;
+  tree->value = value;
+
+  return 0;
+}
+
+#define RBAGGSTACK 64             /* values this small need no malloc() */
+
+/* room for one value on the stack, aligned for any scalar type */
+union rbaggtmp {
+  char buf[RBAGGSTACK];
+  long double ld;
+  void *p;
+  long l;
+};
+
+/*
+ * Combine into out the values of the nodes of subtree node with keys
+ * >= lo (NULL for no bound), in key order. tmp holds one value, queries
+ * leave tree->aggbuf to the updates so readers can run side by side.
+ */
+static void rbaggregate_from (rbtree *tree, rbnode *node, const void *lo,
+                              unsigned long pfx, void *out, void *tmp)
+{
+  if (node == rbnil(tree))
+    return;
+
+  if (lo && rbcompare (tree, lo, pfx, node) > 0) {
+    rbaggregate_from (tree, node->right, lo, pfx, out, tmp);
+    return;
+  }
+
+  rbaggregate_from (tree, node->left, lo, pfx, out, tmp);
+  tree->value (node, tmp);
+  tree->combine (out, out, tmp);
+  if (node->right != rbnil(tree))
+    tree->combine (out, out, node->right->aug);
+}
+
+/*
+ * Combine into out the values of the nodes of subtree node with keys
+ * <= hi (NULL for no bound), in key order.
+ */
+static void rbaggregate_to (rbtree *tree, rbnode *node, const void *hi,
+                            unsigned long pfx, void *out, void *tmp)
+{
+  while (node != rbnil(tree)) {
+    if (hi && rbcompare (tree, hi, pfx, node) < 0) {
+      node = node->left;
+      continue;
+    }
+
+    if (node->left != rbnil(tree))
+      tree->combine (out, out, node->left->aug);
+    tree->value (node, tmp);
+    tree->combine (out, out, tmp);
+    node = node->right;
+  }
+}
+
+/*
+ * Store in out the combined value of every node with lo <= key <= hi, lo
+ * and hi are keys as passed to rbfind(), either may be NULL to leave that
+ * end of the range open. An empty range gives the identity. O(log n).
+ * Safe alongside other readers. Returns 0 on success, -1 if a value
+ * larger than RBAGGSTACK bytes found no memory for its temporary.
+ */
+static int _rbaggregate_range (rbtree *tree, const void *lo,
+                               const void *hi, void *out)
+{
+  rbnode *node = rbfirst(tree);
+  unsigned long lpfx = 0, hpfx = 0;
+  union rbaggtmp stack;
+  void *tmp = stack.buf;
+
+  memcpy (out, rbidentity(tree), tree->aggsz);
+
+  if (tree->aggsz > sizeof stack && !(tmp = malloc (tree->aggsz))) {
+    perror ("malloc-rbaggregate_range()");
+    return -1;
+  }
+
+  if (tree->prefix) {
+    lpfx = lo ? tree->prefix (lo) : 0;
+    hpfx = hi ? tree->prefix (hi) : 0;
+  }
+
+  /* descend to the first node inside the range, where the bounds split */
+  while (node != rbnil(tree)) {
+    if (lo && rbcompare (tree, lo, lpfx, node) > 0)
+      node = node->right;
+    else if (hi && rbcompare (tree, hi, hpfx, node) < 0)
+      node = node->left;
+    else
+      break;
+  }
+  if (node != rbnil(tree)) {
+    rbaggregate_from (tree, node->left, lo, lpfx, out, tmp);
+    tree->value (node, tmp);
+    tree->combine (out, out, tmp);
+    rbaggregate_to (tree, node->right, hi, hpfx, out, tmp);
+  }
+
+  if (tmp != stack.buf)
+    free (tmp);
+
+  return 0;
+}
+
+int rbaggregate_range (rbtree *tree, const void *lo, const void *hi,
+                       void *out)
+{
+  int ret;
+
+  RBPROBE3(aggregate_entry, tree, lo, hi);
+  ret = _rbaggregate_range (tree, lo, hi, out);
+  RBPROBE2(aggregate_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ *  Multiset mode
+ *
+ *  Duplicate keys are counted in the node instead of being stored as
+ *  further nodes, so a repeated insert allocates nothing and rotates
+ *  nothing. The counts are summed over every subtree with aggregate mode,
+ *  which gives totals, ranks and range counts that honor the
+ *  multiplicities in O(log n). node->aug holds two size_t: the subtree
+ *  total, the aggregate value proper, then the node's own count, which
+ *  rbaugment() leaves alone as it only writes aggsz bytes.
+ */
+
+static void rbmulti_combine (void *out, const void *a, const void *b)
+{
+  *(size_t *)out = *(const size_t *)a + *(const size_t *)b;
+}
+
+static void rbmulti_value (const rbnode *node, void *out)
+{
+  *(size_t *)out = rbmcount(node);
+}
+
+#define rbsubtotal(t, n)  ((n) == rbnil(t) ? 0 : *(size_t *)(n)->aug)
+
+/*
+ * Make the empty tree a multiset: rbinsert() and rbinsert_node() of a key
+ * already present add one to the existing node's count (and return it as
+ * before, the new data is not stored), rbdelete() of a node counted more
+ * than once takes one off and returns NULL. Uses aggregate mode, so the
+ * two cannot be combined, and nodes added with rbinsert_node() need
+ * 2 * sizeof (size_t) bytes at node->aug. Returns 0 on success, -1
+ * otherwise.
+ */
+int rbsetmultiset (rbtree *tree)
+{
+  size_t zero = 0;
+
+  if (rbsetaggregate (tree, sizeof zero, &zero, rbmulti_combine,
+                      rbmulti_value) != 0)
+    return -1;
+
+  tree->multiset = 1;
+  tree->nodesz = sizeof (rbnode) + rbaugsz(tree);
+
+  return 0;
+}
+
+/*
+ * Number of items counting every occurrence, rbsize() outside a multiset.
+ */
+size_t rbtotal (rbtree *tree)
+{
+  if (!tree->multiset)
+    return rbsize(tree);
+
+  return rbsubtotal(tree, rbfirst(tree));
+}
+
+/*
+ * Number of items, counting occurrences, with a key below key, or up to
+ * and including it if incl. Reads the subtree totals only.
+ */
+static size_t rbcount_to (rbtree *tree, const void *key, int incl)
+{
+  rbnode *node = rbfirst(tree);
+  unsigned long pfx;
+  size_t rank = 0;
+  int res;
+
+  pfx = tree->prefix ? tree->prefix (key) : 0;
+  while (node != rbnil(tree)) {
+    if ((res = rbcompare (tree, key, pfx, node)) < 0) {
+      node = node->left;
+    }
+    else if (res == 0) {
+      return rank + rbsubtotal(tree, node->left) +
+             (incl ? rbmcount(node) : 0);
+    }
+    else {
+      rank += rbsubtotal(tree, node->left) + rbmcount(node);
+      node = node->right;
+    }
+  }
+
+  return rank;
+}
+
+/*
+ * Number of items, counting occurrences, with a key below key. Multiset
+ * only, 0 for other trees.
+ */
+size_t rbrank (rbtree *tree, const void *key)
+{
+  if (!tree->multiset)
+    return 0;
+
+  return rbcount_to (tree, key, 0);
+}
+
+/*
+ * Node holding item k (from 0, in key order, counting occurrences), or
+ * NULL if k >= rbtotal(tree). Multiset only, NULL for other trees.
+ */
+rbnode *rbselect (rbtree *tree, size_t k)
+{
+  rbnode *node = rbfirst(tree);
+  size_t left;
+
+  if (!tree->multiset)
+    return NULL;
+
+  while (node != rbnil(tree)) {
+    if (k < (left = rbsubtotal(tree, node->left))) {
+      node = node->left;
+    }
+    else if ((k -= left) < rbmcount(node)) {
+      return node;
+    }
+    else {
+      k -= rbmcount(node);
+      node = node->right;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Number of items, counting occurrences, with lo <= key <= hi (NULL for
+ * an open bound). Multiset only, 0 for other trees. Reads the subtree
+ * totals and no scratch, so threads may count on one tree at once.
+ */
+size_t rbcount_range (rbtree *tree, const void *lo, const void *hi)
+{
+  size_t below, upto;
+
+  if (!tree->multiset)
+    return 0;
+
+  below = lo ? rbcount_to (tree, lo, 0) : 0;
+  upto = hi ? rbcount_to (tree, hi, 1) : rbtotal (tree);
+
+  return upto > below ? upto - below : 0;
+}
+
+/*
+ *  Cloning
+ *
+ *  rbclone() copies the shape and colors of a tree node for node, with no
+ *  comparisons or rotations, into a single slab laid out in key order.
+ *  Large trees are split a few levels below the root and the subtrees
+ *  cloned on separate threads: a first round counts each subtree so it
+ *  knows its place in the slab, a second copies it there. The few nodes
+ *  above the split go at the end of the slab.
+ */
+
+#ifndef RBCLONE_PARALLEL
+#define RBCLONE_PARALLEL 65536    /* nodes before rbclone() uses threads */
+#endif
+#define RBSPLIT 2                 /* levels above the threaded subtrees */
+#define RBPARMAX (2 << RBSPLIT)   /* most jobs run by rbparallel() */
+
+struct rbcjob {
+  rbtree *src, *dst;
+  rbnode *node,                   /* source subtree */
+         *copy;                   /* its clone */
+  rbslab *slab;
+  size_t next;                    /* count, then next slab index */
+  void *(*copyfn)(const void *);
+  size_t typesz;
+  int err;
+};
+
+/*
+ * Number of nodes in the subtree at node.
+ */
+static size_t rbclone_count (rbtree *tree, rbnode *node)
+{
+  if (node == rbnil(tree))
+    return 0;
+
+  return 1 + rbclone_count (tree, node->left) +
+             rbclone_count (tree, node->right);
+}
+
+/*
+ * Fill in the next slab node as a copy of node, left is its cloned left
+ * subtree. The right subtree and augmentation are left to the caller.
+ */
+static rbnode *rbclone_one (struct rbcjob *job, rbnode *node, rbnode *left)
+{
+  rbnode *copy = rbslab_node(job->dst, job->slab, job->next);
+
+  job->next++;
+  copy->color = node->color;
+  copy->flags = rbinslab | (node->flags & rbdead);
+  copy->prefix = node->prefix;
+  copy->aug = job->dst->aggsz ? copy + 1 : NULL;
+
+  if (job->copyfn) {
+    if (!(copy->data = job->copyfn (node->data)))
+      job->err = 1;
+  }
+  else if (job->typesz) {
+    if (!(copy->data = malloc (job->typesz))) {
+      perror ("malloc-node->data-rbclone()");
+      job->err = 1;
+    }
+    else
+      memcpy (copy->data, node->data, job->typesz);
+  }
+  else {
+    copy->data = node->data;
+  }
+
+  copy->left = left;
+  if (left != rbnil(job->dst))
+    left->parent = copy;
+
+  return copy;
+}
+
+/*
+ * Augmentation of a clone whose children are complete. Subtree aggregates
+ * (and multiset counts) are the source node's, interval maxima must point
+ * at the cloned data.
+ */
+static void rbclone_aug (struct rbcjob *job, rbnode *node, rbnode *copy)
+{
+  if (job->dst->combine)
+    memcpy (copy->aug, node->aug, rbaugsz(job->dst));
+  else if (job->dst->high && !job->err)
+    rbaugment (job->dst, copy);
+}
+
+/*
+ * Clone the subtree at node, in order into consecutive slab nodes.
+ */
+static rbnode *rbclone_subtree (struct rbcjob *job, rbnode *node)
+{
+  rbnode *copy;
+
+  if (node == rbnil(job->src))
+    return rbnil(job->dst);
+
+  copy = rbclone_one (job, node, rbclone_subtree (job, node->left));
+  if ((copy->right = rbclone_subtree (job, node->right)) != rbnil(job->dst))
+    copy->right->parent = copy;
+  rbclone_aug (job, node, copy);
+
+  return copy;
+}
+
+static void *rbclone_counter (void *arg)
+{
+  struct rbcjob *job = arg;
+
+  job->next = rbclone_count (job->src, job->node);
+
+  return NULL;
+}
+
+static void *rbclone_worker (void *arg)
+{
+  struct rbcjob *job = arg;
+
+  job->copy = rbclone_subtree (job, job->node);
+
+  return NULL;
+}
+
+/*
+ * Run func on each of the n jobs of jobsz bytes at jobs, each on its own
+ * thread where one can be had (one after another without RBTHREADS).
+ */
+static void rbparallel (void *jobs, size_t jobsz, size_t n,
+                        void *(*func)(void *))
+{
+#ifdef RBTHREADS
+  pthread_t th[RBPARMAX];
+  int started[RBPARMAX];
+  char *job = jobs;
+  size_t i;
+
+  for (i = 0; i < n; i++, job += jobsz)
+    if (!(started[i] = pthread_create (th + i, NULL, func, job) == 0))
+      func (job);
+
+  for (i = 0; i < n; i++)
+    if (started[i])
+      pthread_join (th[i], NULL);
+#else
+  char *job = jobs;
+  size_t i;
+
+  for (i = 0; i < n; i++, job += jobsz)
+    func (job);
+#endif
+}
+
+/*
+ * Collect the subtrees RBSPLIT levels below node, in key order.
+ */
+static void rbclone_split (struct rbcjob *job, rbnode *node, int depth,
+                           struct rbcjob *sub, size_t *nsub)
+{
+  if (node == rbnil(job->src))
+    return;
+
+  if (depth == RBSPLIT) {
+    sub[*nsub] = *job;
+    sub[*nsub].node = node;
+    (*nsub)++;
+    return;
+  }
+  rbclone_split (job, node->left, depth + 1, sub, nsub);
+  rbclone_split (job, node->right, depth + 1, sub, nsub);
+}
+
+/*
+ * Clone the levels above the split, taking the cloned subtrees below it
+ * from sub in the order rbclone_split() collected them.
+ */
+static rbnode *rbclone_top (struct rbcjob *job, rbnode *node, int depth,
+                            struct rbcjob *sub, size_t *nsub)
+{
+  rbnode *copy;
+
+  if (node == rbnil(job->src))
+    return rbnil(job->dst);
+
+  if (depth == RBSPLIT)
+    return sub[(*nsub)++].copy;
+
+  copy = rbclone_one (job, node, rbclone_top (job, node->left, depth + 1,
+                                              sub, nsub));
+  copy->right = rbclone_top (job, node->right, depth + 1, sub, nsub);
+  if (copy->right != rbnil(job->dst))
+    copy->right->parent = copy;
+  rbclone_aug (job, node, copy);
+
+  return copy;
+}
+
+/*
+ * Return a copy of tree, with its settings and the same shape, built in
+ * one pass without comparisons and with all nodes in one slab. Data is
+ * copied with copy(data) when copy is not NULL, else into typesz bytes of
+ * new storage (for trees built with rbinsert() and typesz), else the data
+ * pointers are shared. Caller-owned nodes are cloned into tree-owned
+ * ones, so their containers want a copy function. The relocate callback
+ * and its cookie belong to the source and are not copied. evict and reap
+ * are kept when the clone owns its data, and cleared when the data
+ * pointers are shared. Returns NULL if memory or copy() fails, after
+ * passing the copies made up to then to destroy (if not NULL).
+ */
+static rbtree *_rbclone (rbtree *tree, void *(*copy)(const void *),
+                         void (*destroy)(void *), size_t typesz)
+{
+  struct rbcjob job, sub[1 << RBSPLIT];
+  size_t nsub = 0, i;
+  rbtree *clone;
+  rbnode *node;
+  int err = 0;
+
+  if (!(clone = malloc (sizeof *clone))) {
+    perror ("malloc-tree-rbclone()");
+    return NULL;
+  }
+  *clone = *tree;               /* settings, then fix up the rest */
+
+  clone->nil.left = clone->nil.right = clone->nil.parent = rbnil(clone);
+  clone->root.left = clone->root.right = clone->root.parent = rbnil(clone);
+  clone->nuser = 0;              /* every clone node is tree-owned */
+  clone->slabs = clone->oldslabs = NULL;
+  clone->slabfree = clone->cnext = NULL;
+  clone->bound = NULL;
+  clone->aggbuf = NULL;
+  clone->relocate = NULL;
+  clone->rcookie = NULL;
+  if (!copy && !typesz)
+    clone->evict = clone->reap = NULL;     /* data is the source's */
+
+  if (tree->aggsz) {
+    if (!(clone->aggbuf = malloc (2 * tree->aggsz))) {
+      perror ("malloc-aggbuf-rbclone()");
+      free (clone);
+      return NULL;
+    }
+    memcpy (clone->aggbuf, tree->aggbuf, tree->aggsz);
+  }
+
+  if (!tree->count)
+    return clone;
+
+  if (!(clone->slabs = malloc (sizeof *clone->slabs +
+                               tree->count * tree->nodesz))) {
+    perror ("malloc-slab-rbclone()");
+    free (clone->aggbuf);
+    free (clone);
+    return NULL;
+  }
+  clone->slabs->next = NULL;
+  clone->slabs->n = clone->slabs->used = tree->count;
+
+  job.src = tree;
+  job.dst = clone;
+  job.node = rbfirst(tree);
+  job.copy = rbnil(clone);
+  job.slab = clone->slabs;
+  job.next = 0;
+  job.copyfn = copy;
+  job.typesz = typesz;
+  job.err = 0;
+
+  if (tree->count < RBCLONE_PARALLEL) {
+    rbclone_worker (&job);
+    err = job.err;
+  }
+  else {
+    rbclone_split (&job, rbfirst(tree), 0, sub, &nsub);
+    rbparallel (sub, sizeof *sub, nsub, rbclone_counter);
+
+    /* subtrees take the front of the slab in order, the top the rest */
+    for (i = 0; i < nsub; i++) {
+      size_t n = sub[i].next;
+
+      sub[i].next = job.next;
+      job.next += n;
+    }
+    rbparallel (sub, sizeof *sub, nsub, rbclone_worker);
+
+    for (i = 0; i < nsub; i++)
+      err |= sub[i].err;
+    job.err = err;
+    nsub = 0;
+    job.copy = rbclone_top (&job, rbfirst(tree), 0, sub, &nsub);
+    err = job.err;
+  }
+  rbfirst(clone) = job.copy;
+  job.copy->parent = rbroot(clone);
+
+  if (err) {
+    /* every slab node was filled in, a failed copy left its data NULL */
+    if (copy || typesz) {
+      for (i = 0; i < tree->count; i++) {
+        node = rbslab_node(clone, clone->slabs, i);
+        if (!node->data)
+          continue;
+        if (!copy)
+          free (node->data);
+        else if (destroy)
+          destroy (node->data);
+      }
+    }
+    rbdestroy (clone, NULL);
+    return NULL;
+  }
+
+  return clone;
+}
+
+rbtree *rbclone (rbtree *tree, void *(*copy)(const void *),
+                 void (*destroy)(void *), size_t typesz)
+{
+  rbtree *ret;
+
+  RBPROBE1(clone_entry, tree);
+  ret = _rbclone (tree, copy, destroy, typesz);
+  RBPROBE2(clone_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ * Free every node below node without recursion or a stack: a left child
+ * is rotated up until the current node has none, so the node can go and
+ * its right child becomes the current node. The rotations reuse the
+ * child pointers of nodes about to be freed in place of a stack.
+ */
+static void _rbdestroy (rbtree *tree, rbnode *node, void (*destroy)(void *))
+{
+  rbnode *next;
+  unsigned flags;
+
+  while (node != rbnil(tree)) {
+    if ((next = node->left) != rbnil(tree)) {
+      node->left = next->right;
+      next->right = node;
+    }
+    else {
+      next = node->right;
+
+      /* destroy may free the container holding a caller-owned node */
+      flags = node->flags;
+
+      if (destroy != NULL)
+        destroy (node->data);
+
+      if (!(flags & (rbuser | rbinslab)))
+        free (node);
+    }
+    node = next;
+  }
+}
+
+/*
+ * Destroy the specified tree, calling the destructor destroy
+ * for each node and then freeing the tree itself.
+ */
+void rbdestroy (rbtree *tree, void (*destroy)(void *))
+{
+  RBPROBE1(destroy_entry, tree);
+
+  _rbdestroy (tree, rbfirst(tree), destroy);
+
+  rbslab_free (tree->slabs);
+  rbslab_free (tree->oldslabs);
+  free (tree->aggbuf);
+
+  free (tree);
+
+  RBPROBE1(destroy_return, tree);
+}
+
+#ifdef RBTHREADS
+/*
+ * Trees handed to rbdestroy_async() wait in a queue drained by a single
+ * worker thread, started when the queue fills and gone when it empties.
+ */
+struct rbdjob {
+  struct rbdjob *next;
+  rbtree *tree;
+  void (*destroy)(void *);
+};
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t idle;
+  struct rbdjob *head, **tail;
+  int running;                  /* worker thread alive */
+} rbdq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           NULL, &rbdq.head, 0 };
+
+static void *rbdworker (void *arg)
+{
+  struct rbdjob *job;
+
+  (void)arg;
+
+  pthread_mutex_lock (&rbdq.lock);
+  while ((job = rbdq.head)) {
+    if (!(rbdq.head = job->next))
+      rbdq.tail = &rbdq.head;
+    pthread_mutex_unlock (&rbdq.lock);
+
+    rbdestroy (job->tree, job->destroy);
+    free (job);
+
+    pthread_mutex_lock (&rbdq.lock);
+  }
+  rbdq.running = 0;
+  pthread_cond_broadcast (&rbdq.idle);
+  pthread_mutex_unlock (&rbdq.lock);
+
+  return NULL;
+}
+
+/*
+ * Hand tree to a background thread that destroys it as rbdestroy()
+ * would, so the caller only pays O(1). The tree must not be used after
+ * the call, and destroy runs on the worker thread. When no job or thread
+ * can be had the tree is destroyed before returning. Returns 0 when
+ * queued, 1 when destroyed in the caller.
+ */
+int rbdestroy_async (rbtree *tree, void (*destroy)(void *))
+{
+  struct rbdjob *job;
+  pthread_attr_t attr;
+  pthread_t th;
+  int ret = 0;
+
+  if (!(job = malloc (sizeof *job))) {
+    perror ("malloc-job-rbdestroy_async()");
+    rbdestroy (tree, destroy);
+    return 1;
+  }
+  job->next = NULL;
+  job->tree = tree;
+  job->destroy = destroy;
+
+  pthread_mutex_lock (&rbdq.lock);
+  *rbdq.tail = job;
+  rbdq.tail = &job->next;
+
+  if (!rbdq.running) {
+    pthread_attr_init (&attr);
+    pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create (&th, &attr, rbdworker, NULL) == 0) {
+      rbdq.running = 1;
+    }
+    else {
+      /* no worker, take the job back off the queue */
+      for (rbdq.tail = &rbdq.head; *rbdq.tail != job; )
+        rbdq.tail = &(*rbdq.tail)->next;
+      *rbdq.tail = NULL;
+      ret = 1;
+    }
+    pthread_attr_destroy (&attr);
+  }
+  pthread_mutex_unlock (&rbdq.lock);
+
+  if (ret) {
+    rbdestroy (tree, destroy);
+    free (job);
+  }
+
+  return ret;
+}
+
+/*
+ * Block until every tree handed to rbdestroy_async() has been destroyed,
+ * e.g. before exit.
+ */
+void rbdestroy_wait (void)
+{
+  pthread_mutex_lock (&rbdq.lock);
+  while (rbdq.running)
+    pthread_cond_wait (&rbdq.idle, &rbdq.lock);
+  pthread_mutex_unlock (&rbdq.lock);
+}
+
+#else
+
+/* built without RBTHREADS, the tree is always destroyed in the caller */
+int rbdestroy_async (rbtree *tree, void (*destroy)(void *))
+{
+  rbdestroy (tree, destroy);
+
+  return 1;
+}
+
+void rbdestroy_wait (void)
+{
+}
+
+#endif /* RBTHREADS */
+
+/*
+ * Unlink node 'z' from the tree and rebalance without freeing it. The
+ * node's memory belongs to the caller once unlinked. If z has two
+ * children, its successor is moved into z's position, so no node other
+ * than z changes identity.
+ */
+void rbunlink (rbtree *tree, rbnode *z)
+{
+  rbnode *x, *y, *fix;
+
+  /* keep an incremental compaction's cursor off the departing node */
+  if (tree->cnext == z)
+    tree->cnext = rbnext(tree, z);
+  if (tree->bound == z)
+    tree->bound = NULL;
+  if (z->flags & rbdead)
+    tree->ndead--;
+  if (z->flags & rbuser)
+    tree->nuser--;
+  tree->count--;
+
+  if (z->left == rbnil(tree) || z->right == rbnil(tree))
+    y = z;
+  else
+    y = rbnext(tree, z);
+
+  x = (y->left == rbnil(tree)) ? y->right : y->left;
+
+  /* lowest node whose subtree loses data, once y has taken z's place */
+  fix = y->parent == z ? y : y->parent;
+
+  if ((x->parent = y->parent) == rbroot(tree)) {
+    rbfirst(tree) = x;
+  }
+  else {
+    if (y == y->parent->left)
+      y->parent->left = x;
+    else
+      y->parent->right = x;
+  }
+
+  if (y->color == black)
+    rbrepair(tree, x);
+
+  if (y != z) {
+    y->left = z->left;
+    y->right = z->right;
+    y->parent = z->parent;
+    y->color = z->color;
+    z->left->parent = z->right->parent = y;
+    if (z == z->parent->left)
+      z->parent->left = y;
+    else
+      z->parent->right = y;
+  }
+
+  if (rbaugmented(tree))
+    rbaugment_path (tree, fix);
+}
+
+/*
+ * Delete node 'z' from the tree and return its data pointer. Caller-owned
+ * nodes added with rbinsert_node() are unlinked but not freed, nodes in a
+ * compaction slab are released with the slab. In a multiset a key counted
+ * more than once only loses one occurrence and NULL is returned.
+ */
+static void *_rbdelete (rbtree *tree, rbnode *z)
+{
+  void *data = z->data;
+
+  if (tree->multiset && rbmcount(z) > 1) {
+    rbmcount(z)--;
+    rbaugment_path (tree, z);
+    return NULL;
+  }
+
+  rbunlink (tree, z);
+  rbfree_node (tree, z, z->flags);
+
+  return data;
+}
+
+void *rbdelete (rbtree *tree, rbnode *z)
+{
+  void *ret;
+  RBCLOCK(t0);
+
+  RBPROBE2(delete_entry, tree, z);
+  ret = _rbdelete (tree, z);
+  RBPROBE2(delete_return, tree, ret);
+  RBRECORD(rbstat_delete, t0);
+
+  return ret;
+}
+
+/*
+ *  Lazy deletion
+ *
+ *  rbdelete_lazy() only marks a node dead, leaving it linked so that no
+ *  rotation or free happens on the caller's path. Lookups, iteration and
+ *  rbapply() skip dead nodes, and rbinsert() of a matching key revives
+ *  one. rbpurge() then removes every dead node in a single pass.
+ */
+
+/*
+ * Have rbdelete_lazy() call rbpurge() once dead nodes make up pct percent
+ * of the linked nodes (0, the default, never purges on its own). reap, if
+ * not NULL, is called on the data of every node a purge removes. Returns
+ * 0 on success, -1 if pct is over 100.
+ */
+int rbsetpurge (rbtree *tree, unsigned pct, void (*reap)(void *))
+{
+  if (pct > 100)
+    return -1;
+
+  tree->purgepct = pct;
+  tree->reap = reap;
+
+  return 0;
+}
+
+/*
+ * Delete node in O(1) by marking it dead; its data stays in place for
+ * comparisons until a purge hands it to reap. Interval, aggregate and
+ * bounded trees would have to keep dead nodes out of their summaries, so
+ * there the node is unlinked and reaped at once. Returns 0 on success, -1
+ * if node is already dead.
+ */
+static int _rbdelete_lazy (rbtree *tree, rbnode *node)
+{
+  if (node->flags & rbdead)
+    return -1;
+
+  if (tree->multiset && rbmcount(node) > 1) {
+    rbmcount(node)--;
+    rbaugment_path (tree, node);
+    return 0;
+  }
+
+  if (rbaugmented(tree) || tree->capacity) {
+    rbunlink (tree, node);
+    rbreap (tree, node);
+    return 0;
+  }
+
+  node->flags |= rbdead;
+  tree->ndead++;
+
+  if (tree->purgepct && tree->ndead * 100 >= tree->purgepct * tree->count)
+    rbpurge (tree);
+
+  return 0;
+}
+
+int rbdelete_lazy (rbtree *tree, rbnode *node)
+{
+  int ret;
+  RBCLOCK(t0);
+
+  RBPROBE2(delete_lazy_entry, tree, node);
+  ret = _rbdelete_lazy (tree, node);
+  RBPROBE2(delete_lazy_return, tree, ret);
+  RBRECORD(rbstat_delete_lazy, t0);
+
+  return ret;
+}
+
+/*
+ * Build a balanced subtree from the n in-order nodes in v, each subtree
+ * split at its middle. Such a tree is complete down to its last row, so
+ * coloring that row red (redrow, -1 when the tree is perfect) and all
+ * else black satisfies the redblack rules.
+ */
+static rbnode *rbbuild (rbtree *tree, rbnode **v, size_t n, rbnode *parent,
+                        int depth, int redrow)
+{
+  rbnode *node;
+  size_t mid = n / 2;
+
+  if (n == 0)
+    return rbnil(tree);
+
+  node = v[mid];
+  node->parent = parent;
+  node->color = depth == redrow ? red : black;
+  node->left = rbbuild (tree, v, mid, node, depth + 1, redrow);
+  node->right = rbbuild (tree, v + mid + 1, n - mid - 1, node, depth + 1,
+                         redrow);
+  if (rbaugmented(tree))
+    rbaugment (tree, node);
+
+  return node;
+}
+
+/*
+ * Remove all dead nodes. The live nodes are collected in order and the
+ * tree rebuilt around them in O(n) with no rotations; should the O(n)
+ * pointer array not be available, dead nodes are unlinked one by one.
+ * Returns the number of nodes removed.
+ */
+static size_t _rbpurge (rbtree *tree)
+{
+  rbnode **v, *node, *next;
+  size_t n = 0, ndead = tree->ndead, d;
+  int depth = 0, resume = 0;
+
+  if (!ndead)
+    return 0;
+
+  for (node = rbfirst(tree); node->left != rbnil(tree); )
+    node = node->left;
+
+  if (!(v = malloc (tree->count * sizeof *v))) {
+    perror ("malloc-v-rbpurge()");
+    for (; node != rbnil(tree); node = next) {
+      next = rbnext (tree, node);
+      if (node->flags & rbdead) {
+        rbunlink (tree, node);
+        rbreap (tree, node);
+      }
+    }
+    return ndead;
+  }
+
+  /* live nodes fill v from the front, dead ones from the back */
+  for (d = tree->count; node != rbnil(tree); node = rbnext (tree, node)) {
+    if (node->flags & rbdead) {
+      /* an incremental compaction resumes at the next live node */
+      if (node == tree->cnext)
+        resume = 1;
+      v[--d] = node;
+    }
+    else {
+      if (resume) {
+        tree->cnext = node;
+        resume = 0;
+      }
+      v[n++] = node;
+    }
+  }
+  if (resume)
+    tree->cnext = rbnil(tree);
+
+  for (d = n; d > 1; d >>= 1)
+    depth++;
+  rbfirst(tree) = rbbuild (tree, v, n, rbroot(tree), 0,
+                           (n & (n + 1)) == 0 ? -1 : depth);
+
+  tree->count = n;
+  tree->ndead = 0;
+  tree->bound = NULL;
+
+  for (d = n; d < n + ndead; d++) {
+    if (v[d]->flags & rbuser)
+      tree->nuser--;
+    rbreap (tree, v[d]);
+  }
+  free (v);
+
+  return ndead;
+}
+
+size_t rbpurge (rbtree *tree)
+{
+  size_t ret;
+
+  RBPROBE1(purge_entry, tree);
+  ret = _rbpurge (tree);
+  RBPROBE2(purge_return, tree, ret);
+
+  return ret;
+}
+
+/*
+ *  Latency histograms
+ *
+ *  Each histogram counts nanoseconds in log buckets: values below
+ *  RBHIST_SUB have a bucket each, above that every power of two is split
+ *  into RBHIST_SUB equal buckets, so a bucket is within 1/RBHIST_SUB of
+ *  its values. Counters are updated atomically and may be read or reset
+ *  while other threads record.
+ */
+
+static rbhist rbhists[rbstat_ops];
+
+#ifdef __GNUC__
+#define rbatomic_add(p, v)  __sync_fetch_and_add ((p), (v))
+#define rbatomic_cas(p, o, n) __sync_bool_compare_and_swap ((p), (o), (n))
+#define rbatomic_load(p)    __sync_fetch_and_add ((p), 0)
+#define rbatomic_swap(p, v) __sync_lock_test_and_set ((p), (v))
+#else
+#define rbatomic_add(p, v)  (*(p) += (v))
+#define rbatomic_cas(p, o, n) (*(p) = (n), 1)
+#define rbatomic_load(p)    (*(p))
+#define rbatomic_swap(p, v) (*(p) = (v))
+#endif
+
+/*
+ * Smallest value counted in bucket i.
+ */
+static unsigned long rbhist_low (size_t i)
+{
+  if (i < RBHIST_SUB)
+    return i;
+
+  return (unsigned long)(RBHIST_SUB + i % RBHIST_SUB) << (i / RBHIST_SUB - 1);
+}
+
+#ifdef RBSTATS
+/*
+ * Bucket counting value v.
+ */
+static size_t rbhist_bucket (unsigned long v)
+{
+  size_t shift = 0;
+
+  if (v < RBHIST_SUB)
+    return v;
+
+  while ((v >> shift) >= 2 * RBHIST_SUB)
+    shift++;
+
+  return (shift + 1) * RBHIST_SUB + ((v >> shift) - RBHIST_SUB);
+}
+
+static unsigned long rbclock (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void rbrecord (enum rbstat op, unsigned long t0)
+{
+  rbhist *h = rbhists + op;
+  unsigned long ns = rbclock () - t0, max;
+
+  rbatomic_add (h->bucket + rbhist_bucket (ns), 1);
+  rbatomic_add (&h->count, 1);
+  rbatomic_add (&h->total, ns);
+  while ((max = h->max) < ns && !rbatomic_cas (&h->max, max, ns))
+    ;
+}
+#endif
+
+/*
+ * Copy the latency histogram of op into h. All counts are zero unless
+ * built with -DRBSTATS.
+ */
+void rbstats_get (enum rbstat op, rbhist *h)
+{
+  rbhist *src = rbhists + op;
+  size_t i;
+
+  h->count = rbatomic_load (&src->count);
+  h->total = rbatomic_load (&src->total);
+  h->max = rbatomic_load (&src->max);
+  for (i = 0; i < RBHIST_BUCKETS; i++)
+    h->bucket[i] = rbatomic_load (src->bucket + i);
+}
+
+/*
+ * Zero the histograms of all operations. Each counter is swapped with 0
+ * in one atomic step, so no concurrent recording is lost, though one
+ * may land on either side of the reset.
+ */
+void rbstats_reset (void)
+{
+  rbhist *h;
+  size_t i;
+
+  for (h = rbhists; h < rbhists + rbstat_ops; h++) {
+    for (i = 0; i < RBHIST_BUCKETS; i++)
+      rbatomic_swap (h->bucket + i, 0);
+    rbatomic_swap (&h->count, 0);
+    rbatomic_swap (&h->total, 0);
+    rbatomic_swap (&h->max, 0);
+  }
+}
+
+/*
+ * Latency in nanoseconds that pct percent (0 - 100) of the operations
+ * counted in h did not exceed, as the low end of its bucket.
+ */
+unsigned long rbstats_percentile (const rbhist *h, double pct)
+{
+  unsigned long seen = 0, want;
+  double rank;
+  size_t i;
+
+  if (!h->count)
+    return 0;
+
+  /* the operation of rank ceil(count * pct / 100), counting from 1 */
+  rank = h->count * (pct / 100.0);
+  want = (unsigned long)rank;
+  if (want < rank)
+    want++;
+  if (want < 1)
+    want = 1;
+
+  for (i = 0; i < RBHIST_BUCKETS; i++)
+    if ((seen += h->bucket[i]) >= want)
+      return rbhist_low (i);
+
+  return h->max;
+}
+
+/*
+ *  Flattening
+ *
+ *  rbflatten() and rbflatten_range() write the in-order contents of a
+ *  tree to caller arrays, walking node to node without recursion or
+ *  callbacks. Large trees are cut into the subtrees RBSPLIT levels down
+ *  and the nodes above them; a first round counts every piece so it
+ *  knows where its output starts, a second writes the pieces on separate
+ *  threads. rbload() turns the output back into a tree in O(n).
+ */
+
+#ifndef RBFLATTEN_PARALLEL
+#define RBFLATTEN_PARALLEL 262144   /* nodes before rbflatten() uses threads */
+#endif
+
+struct rbfjob {
+  rbtree *tree;
+  rbnode *first,
+         *stop;                     /* walk first up to, not including, stop */
+  char *keys;
+  size_t keysz;
+  void **data;
+  size_t n,                         /* live nodes in the piece */
+         at;                        /* index of its first in the output */
+};
+
+/*
+ * Write up to n live nodes from node on, stopping at stop, to keys (the
+ * first keysz bytes of each data item) and data (the data pointers),
+ * either of which may be NULL. Returns the nodes written.
+ */
+static size_t rbflatten_walk (rbtree *tree, rbnode *node, rbnode *stop,
+                              char *keys, size_t keysz, void **data,
+                              size_t n)
+{
+  size_t i = 0;
+
+  for (; node != stop && i < n; node = rbnext (tree, node)) {
+    if (node->flags & rbdead)
+      continue;
+    if (keys)
+      memcpy (keys + i * keysz, node->data, keysz);
+    if (data)
+      data[i] = node->data;
+    i++;
+  }
+
+  return i;
+}
+
+/*
+ * First node, dead or alive, whose key is not below key (above key when
+ * upper is set), or nil.
+ */
+static rbnode *rbbound (rbtree *tree, const void *key, int upper)
+{
+  rbnode *node = rbfirst(tree),
+         *found = rbnil(tree);
+  unsigned long pfx = tree->prefix ? tree->prefix (key) : 0;
+  int res;
+
+  while (node != rbnil(tree)) {
+    if ((res = rbcompare (tree, key, pfx, node)) < 0 || (res == 0 && !upper)) {
+      found = node;
+      node = node->left;
+    }
+    else
+      node = node->right;
+  }
+
+  return found;
+}
+
+static void *rbflatten_counter (void *arg)
+{
+  struct rbfjob *job = arg;
+
+  job->n = rbflatten_walk (job->tree, job->first, job->stop, NULL, 0, NULL,
+                           (size_t)-1);
+
+  return NULL;
+}
+
+static void *rbflatten_worker (void *arg)
+{
+  struct rbfjob *job = arg;
+
+  rbflatten_walk (job->tree, job->first, job->stop,
+                  job->keys ? job->keys + job->at * job->keysz : NULL,
+                  job->keysz, job->data ? job->data + job->at : NULL,
+                  job->n);
+
+  return NULL;
+}
+
+/*
+ * Cut the tree at node into in-order pieces: the subtrees RBSPLIT levels
+ * down, and single nodes above them.
+ */
+static void rbflatten_split (struct rbfjob *job, rbnode *node, int depth,
+                             struct rbfjob *piece, size_t *npiece)
+{
+  rbtree *tree = job->tree;
+  rbnode *last;
+
+  if (node == rbnil(tree))
+    return;
+
+  if (depth < RBSPLIT)
+    rbflatten_split (job, node->left, depth + 1, piece, npiece);
+
+  piece[*npiece] = *job;
+  piece[*npiece].first = node;
+  last = node;
+  if (depth == RBSPLIT) {
+    while (piece[*npiece].first->left != rbnil(tree))
+      piece[*npiece].first = piece[*npiece].first->left;
+    while (last->right != rbnil(tree))
+      last = last->right;
+  }
+  piece[*npiece].stop = rbnext (tree, last);
+  (*npiece)++;
+
+  if (depth < RBSPLIT)
+    rbflatten_split (job, node->right, depth + 1, piece, npiece);
+}
+
+/*
+ * Write the live data of tree in key order: the first keysz bytes of each
+ * item to the array keys (packed, keysz apart) and the data pointers to
+ * data. Either may be NULL, at most n items are written. Trees of
+ * RBFLATTEN_PARALLEL nodes or more that fit in n are written by several
+ * threads. Returns the number of items written.
+ */
+size_t rbflatten (rbtree *tree, void *keys, size_t keysz, void **data,
+                  size_t n)
+{
+  struct rbfjob job, piece[RBPARMAX];
+  size_t npiece = 0, i;
+
+  job.tree = tree;
+  job.keys = keys;
+  job.keysz = keysz;
+  job.data = data;
+  job.at = 0;
+
+  if (tree->count < RBFLATTEN_PARALLEL || n < rbsize(tree)) {
+    for (job.first = rbfirst(tree); job.first->left != rbnil(tree); )
+      job.first = job.first->left;
+    return rbflatten_walk (tree, job.first, rbnil(tree), keys, keysz, data, n);
+  }
+
+  rbflatten_split (&job, rbfirst(tree), 0, piece, &npiece);
+  rbparallel (piece, sizeof *piece, npiece, rbflatten_counter);
+  for (i = 0; i < npiece; i++) {
+    piece[i].at = job.at;
+    job.at += piece[i].n;
+  }
+  rbparallel (piece, sizeof *piece, npiece, rbflatten_worker);
+
+  return job.at;
+}
+
+/*
+ * rbflatten() limited to the keys lo <= key <= hi, pass NULL for either
+ * bound to leave it open. Always a single thread.
+ */
+size_t rbflatten_range (rbtree *tree, const void *lo, const void *hi,
+                        void *keys, size_t keysz, void **data, size_t n)
+{
+  rbnode *first, *stop;
+
+  if (lo && hi && tree->compar (lo, hi) > 0)
+    return 0;
+
+  if (lo) {
+    first = rbbound (tree, lo, 0);
+  }
+  else {
+    for (first = rbfirst(tree); first->left != rbnil(tree); )
+      first = first->left;
+  }
+  stop = hi ? rbbound (tree, hi, 1) : rbnil(tree);
+
+  return rbflatten_walk (tree, first, stop, keys, keysz, data, n);
+}
+
+/*
+ * Fill the empty tree with the n items of data, in strictly ascending key
+ * order as rbflatten() writes them, in O(n) with no rotations. The nodes
+ * share one slab, typesz is as for rbinsert(). Returns 0 on success, -1 if
+ * the tree is not empty (or n is over its capacity), data is out of order
+ * or memory runs out.
+ */
+int rbload (rbtree *tree, void **data, size_t n, size_t typesz)
+{
+  rbslab *slab;
+  rbnode **v, *node;
+  size_t i, d;
+  int depth = 0;
+
+  if (tree->count || (tree->capacity && n > tree->capacity))
+    return -1;
+  if (n == 0)
+    return 0;
+
+  for (i = 1; i < n; i++)
+    if (tree->compar (data[i - 1], data[i]) >= 0)
+      return -1;
+
+  if (!(slab = malloc (sizeof *slab + n * tree->nodesz))) {
+    perror ("malloc-slab-rbload()");
+    return -1;
+  }
+  if (!(v = malloc (n * sizeof *v))) {
+    perror ("malloc-v-rbload()");
+    free (slab);
+    return -1;
+  }
+
+  for (i = 0; i < n; i++) {
+    node = v[i] = rbslab_node(tree, slab, i);
+    node->flags = rbinslab;
+    node->aug = tree->aggsz ? node + 1 : NULL;
+    node->prefix = tree->prefix ? tree->prefix (data[i]) : 0;
+    if (tree->multiset)
+      rbmcount(node) = 1;
+    if (typesz == 0) {
+      node->data = data[i];
+    }
+    else if ((node->data = malloc (typesz))) {
+      memcpy (node->data, data[i], typesz);
+    }
+    else {
+      perror ("malloc-node->data-rbload()");
+      while (i--)
+        free (v[i]->data);
+      free (v);
+      free (slab);
+      return -1;
+    }
+  }
+
+  slab->n = slab->used = n;
+  slab->next = tree->slabs;
+  tree->slabs = slab;
+
+  for (d = n; d > 1; d >>= 1)
+    depth++;
+  rbfirst(tree) = rbbuild (tree, v, n, rbroot(tree), 0,
+                           (n & (n + 1)) == 0 ? -1 : depth);
+  tree->count = n;
+  if (tree->capacity && n == tree->capacity)
+    tree->bound = _rbmin (tree);
+
+  free (v);
+
+  return 0;
+}
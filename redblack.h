@@ -36,11 +36,34 @@
 #ifndef _REDBLACK_H
 #define _REDBLACK_H
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum rbcolor {
   red,
   black
 };
 
+/* operations with a latency histogram, see rbstats_get() */
+enum rbstat {
+  rbstat_insert,
+  rbstat_find,
+  rbstat_delete,
+  rbstat_insert_node,
+  rbstat_delete_lazy,
+  rbstat_ops
+};
+
+/* rbnode flags */
+enum rbnodeflag {
+  rbuser   = 1,   /* node memory belongs to the caller, never freed */
+  rbinslab = 2,   /* node lives in a tree-owned slab, see rbcompact() */
+  rbdead   = 4    /* deleted but still linked, see rbdelete_lazy() */
+};
+
 enum rbtraversal {
   preorder,
   inorder,
@@ -53,26 +76,86 @@ typedef struct rbnode {
                 *parent;
   void *data;
   enum rbcolor color;
+  unsigned flags;
+  unsigned long prefix;   /* inline key prefix, see rbsetprefix() */
+  void *aug;              /* subtree augmentation, see rbsetinterval(),
+                             rbsetaggregate() and rbsetmultiset() */
 } rbnode;
 
 typedef struct rbtree {
   int (*compar)(const void *, const void *);
+  unsigned long (*prefix)(const void *);
   struct rbnode root,
                 nil,
                 err;
+  size_t count,                 /* nodes linked in the tree, dead included */
+         nuser;                 /* of which caller-owned (rbuser) */
+
+  /* compaction state, see rbcompact() */
+  struct rbslab *slabs,         /* slabs holding live nodes */
+                *oldslabs;      /* slabs being emptied by compaction */
+  rbnode *slabfree,             /* free slab slots, linked by ->parent */
+         *cnext;                /* next node to relocate, NULL if idle */
+  void (*relocate)(rbnode *, rbnode *, void *);
+  void *rcookie;
+
+  /* interval mode endpoint access, see rbsetinterval() */
+  const void *(*low)(const void *);
+  const void *(*high)(const void *);
+  int (*epcmp)(const void *, const void *);
+
+  /* aggregate mode monoid, see rbsetaggregate() */
+  size_t aggsz,
+         nodesz;                /* bytes per tree-allocated node */
+  void (*combine)(void *, const void *, const void *);
+  void (*value)(const rbnode *, void *);
+  void *aggbuf;                 /* identity, then scratch value */
+
+  /* bounded (top-k) mode, see rbsetcapacity() */
+  size_t capacity;
+  rbnode *bound;                /* cached minimum once full */
+  void (*evict)(void *);
+
+  /* lazy deletion, see rbdelete_lazy() */
+  size_t ndead;                 /* dead nodes still linked */
+  unsigned purgepct;            /* automatic rbpurge() threshold, 0 off */
+  void (*reap)(void *);         /* destructor for data of purged nodes */
+
+  int multiset;                 /* see rbsetmultiset() */
 } rbtree;
 
 #define rbapply(t, f, c, o) rbapply_node((t), (t)->root.left, (f), (c), (o))
-#define rbisempty(t)        ((t)->root.left == &(t)->nil && (t)->root.right == &(t)->nil)
+#define rbsize(t)           ((t)->count - (t)->ndead)
+#define rbisempty(t)        (rbsize(t) == 0)
 #define rbfirst(t)          ((t)->root.left)
 #define rbroot(t)           (&(t)->root)
 #define rbnil(t)            (&(t)->nil)
 #define rberr(t)            (&(t)->err)
 
+/* latency histogram buckets, RBHIST_SUB per power of two of nanoseconds */
+#define RBHIST_SUB          8
+#define RBHIST_BUCKETS      (RBHIST_SUB * (8 * sizeof (unsigned long) - 2))
+
+typedef struct rbhist {
+  unsigned long count,          /* operations timed */
+                total,          /* their nanoseconds */
+                max;
+  unsigned long bucket[RBHIST_BUCKETS];
+} rbhist;
+
+/* recover the struct containing an embedded rbnode (intrusive use) */
+#define rbentry(p, type, member) \
+        ((type *)((char *)(p) - offsetof(type, member)))
+
 int rbapply_node            (rbtree *, rbnode *,
                             int (*)(void *, void *), void *, enum rbtraversal);
 rbtree *rbcreate            (int (*)(const void *, const void *));
+int rbsetprefix             (rbtree *, unsigned long (*)(const void *));
+int rbsetcapacity           (rbtree *, size_t, void (*)(void *));
+unsigned long rbprefix_str  (const void *);
 rbnode *rbinsert            (rbtree *, void *, size_t);
+void rblink                 (rbtree *, rbnode *, rbnode *, int);
+rbnode *rbinsert_node       (rbtree *, rbnode *);
 
 rbnode *rbfind              (rbtree *, void *);
 rbnode *rbmin               (rbtree *);
@@ -83,8 +166,48 @@ int rbtraverse              (rbtree *, rbnode *,
                             int (*)(void *, void *), void *, enum rbtraversal);
 rbnode *rbreplace           (rbtree *, rbnode *, rbnode *);
 
+int rbsetinterval           (rbtree *, const void *(*)(const void *),
+                            const void *(*)(const void *),
+                            int (*)(const void *, const void *));
+int rbinterval_overlaps     (rbtree *, const void *, const void *,
+                            int (*)(void *, void *), void *);
+rbnode *rbinterval_any      (rbtree *, const void *, const void *);
+int rbsetaggregate          (rbtree *, size_t, const void *,
+                            void (*)(void *, const void *, const void *),
+                            void (*)(const rbnode *, void *));
+int rbaggregate_range       (rbtree *, const void *, const void *, void *);
+int rbsetmultiset           (rbtree *);
+size_t rbtotal              (rbtree *);
+size_t rbrank               (rbtree *, const void *);
+rbnode *rbselect            (rbtree *, size_t);
+size_t rbcount_range        (rbtree *, const void *, const void *);
+int rbsetrelocate           (rbtree *, void (*)(rbnode *, rbnode *, void *),
+                            void *);
+int rbcompact_step          (rbtree *, size_t);
+int rbcompact               (rbtree *);
+
+rbtree *rbclone             (rbtree *, void *(*)(const void *),
+                            void (*)(void *), size_t);
+size_t rbflatten            (rbtree *, void *, size_t, void **, size_t);
+size_t rbflatten_range      (rbtree *, const void *, const void *,
+                            void *, size_t, void **, size_t);
+int rbload                  (rbtree *, void **, size_t, size_t);
+
 void rbdestroy              (rbtree *, void (*)(void *));
+int rbdestroy_async         (rbtree *, void (*)(void *));
+void rbdestroy_wait         (void);
 void *rbdelete              (rbtree *, rbnode *);
+void rbunlink               (rbtree *, rbnode *);
+int rbsetpurge              (rbtree *, unsigned, void (*)(void *));
+int rbdelete_lazy           (rbtree *, rbnode *);
+size_t rbpurge              (rbtree *);
+
+void rbstats_get            (enum rbstat, rbhist *);
+void rbstats_reset          (void);
+unsigned long rbstats_percentile (const rbhist *, double);
 
+#ifdef __cplusplus
+}
+#endif
 
 #endif /* _REDBLACK_H */
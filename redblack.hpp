@@ -0,0 +1,454 @@
+/**
+ *  C++ template front end to the redblack tree.
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ *  ANY DAMAGES, WHETHER SPECIAL, DIRECT, INDIRECT, CONSEQUENTIAL OR OTHERWISE
+ *  OR ANY DAMAGES WHATSOEVER, WHETHER SOUNDING IN CONTRACT, NEGLIGENCE, TORT,
+ *  OR OTHER ACTION ARISING OUT OF, OR IN CONNECTION WITH, ANY AND ALL USE OF
+ *  THIS SOFTWARE BY ANY USER OF THIS SOFTWARE, OR ANYONE CLAIMING BY THROUGH
+ *  OR UNDER AND PERSON OR ENTITY MAKING USE OF THIS SOFTWARE.
+ *
+ *  This Software is Licence Under the GNU Public Licenxe, GPLv2.
+ *
+ *  Copyright (c) 2015-2023 David C. Rankin,J.D.,P.E. <drankinatty@gmail.com>
+ */
+
+/*
+ * rb::map<K, V, Compare> stores keys and values inline in the tree nodes
+ * (one allocation per element, no void* payload) and does its own descent
+ * with the Compare functor so comparisons are inlined. Linking, unlinking
+ * and rebalancing are handed to rblink() and rbunlink() in redblack.c, so
+ * programs using this header must link with redblack.o.
+ *
+ * The interface follows std::map closely enough for <algorithm>; iterators
+ * are bidirectional and stay valid until the element they refer to is
+ * erased. A moved-from map holds no rbtree and gets a new one on its
+ * next insert, so moves and swaps never allocate or throw.
+ */
+
+#ifndef _REDBLACK_HPP
+#define _REDBLACK_HPP
+
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include "redblack.h"
+
+namespace rb {
+
+template <class K, class V, class Compare = std::less<K> >
+class map {
+public:
+  typedef K                             key_type;
+  typedef V                             mapped_type;
+  typedef std::pair<const K, V>         value_type;
+  typedef Compare                       key_compare;
+  typedef std::size_t                   size_type;
+  typedef std::ptrdiff_t                difference_type;
+  typedef value_type&                   reference;
+  typedef const value_type&             const_reference;
+
+private:
+  /* element node, the rbnode base is what the C tree links together */
+  struct node : rbnode {
+    value_type value;
+
+    template <class... Args>
+    explicit node (Args&&... args) : value(std::forward<Args>(args)...) {}
+  };
+
+  template <class T, class N>
+  class iter {
+  public:
+    typedef std::bidirectional_iterator_tag   iterator_category;
+    typedef typename map::value_type          value_type;
+    typedef std::ptrdiff_t                    difference_type;
+    typedef T*                                pointer;
+    typedef T&                                reference;
+
+    iter () : tree(0), cur(0) {}
+    iter (rbtree *t, rbnode *n) : tree(t), cur(n) {}
+
+    /* allow iterator -> const_iterator */
+    template <class U, class M>
+    iter (const iter<U, M>& o) : tree(o.tree), cur(o.cur) {}
+
+    reference operator* () const { return static_cast<N*>(cur)->value; }
+    pointer operator-> () const { return &static_cast<N*>(cur)->value; }
+
+    iter& operator++ () { cur = rbsuccessor (tree, cur); return *this; }
+    iter operator++ (int) { iter t(*this); ++*this; return t; }
+
+    /* --end() is the maximum, as with std::map */
+    iter& operator-- () {
+      cur = cur == rbnil(tree) ? rbmax (tree) : rbprior (tree, cur);
+      return *this;
+    }
+    iter operator-- (int) { iter t(*this); --*this; return t; }
+
+    template <class U, class M>
+    bool operator== (const iter<U, M>& o) const { return cur == o.cur; }
+    template <class U, class M>
+    bool operator!= (const iter<U, M>& o) const { return cur != o.cur; }
+
+  private:
+    template <class, class> friend class iter;
+    friend class map;
+
+    rbtree *tree;
+    rbnode *cur;
+  };
+
+public:
+  typedef iter<value_type, node>              iterator;
+  typedef iter<const value_type, const node>  const_iterator;
+  typedef std::reverse_iterator<iterator>       reverse_iterator;
+  typedef std::reverse_iterator<const_iterator> const_reverse_iterator;
+
+  explicit map (const Compare& c = Compare()) : tree(create()), cmp(c), n(0) {}
+
+  map (const map& o) : tree(create()), cmp(o.cmp), n(0)
+  {
+    try {
+      for (const_iterator it = o.begin(); it != o.end(); ++it)
+        emplace_hint (end(), *it);
+    }
+    catch (...) {
+      clear();
+      rbdestroy (tree, 0);
+      throw;
+    }
+  }
+
+  /* o is left empty but usable, with no tree until its next insert */
+  map (map&& o) noexcept : tree(o.tree), cmp(o.cmp), n(o.n)
+  {
+    o.tree = 0;
+    o.n = 0;
+  }
+
+  map& operator= (map o) noexcept { swap (o); return *this; }
+
+  ~map ()
+  {
+    if (!tree)
+      return;
+    clear();
+    rbdestroy (tree, 0);      /* tree is empty, frees only the rbtree */
+  }
+
+  void swap (map& o) noexcept
+  {
+    std::swap (tree, o.tree);
+    std::swap (cmp, o.cmp);
+    std::swap (n, o.n);
+  }
+
+  /* iterators */
+  iterator begin () { return iterator(tree, tree ? rbmin (tree) : 0); }
+  iterator end () { return iterator(tree, nil()); }
+  const_iterator begin () const { return const_iterator(tree, tree ? rbmin (tree) : 0); }
+  const_iterator end () const { return const_iterator(tree, nil()); }
+  const_iterator cbegin () const { return begin(); }
+  const_iterator cend () const { return end(); }
+  reverse_iterator rbegin () { return reverse_iterator(end()); }
+  reverse_iterator rend () { return reverse_iterator(begin()); }
+  const_reverse_iterator rbegin () const { return const_reverse_iterator(end()); }
+  const_reverse_iterator rend () const { return const_reverse_iterator(begin()); }
+
+  /* capacity */
+  bool empty () const { return n == 0; }
+  size_type size () const { return n; }
+  key_compare key_comp () const { return cmp; }
+
+  /* lookup */
+  iterator find (const K& key) { return iterator(tree, search (key)); }
+  const_iterator find (const K& key) const { return const_iterator(tree, search (key)); }
+  size_type count (const K& key) const { return search (key) != nil(); }
+
+  iterator lower_bound (const K& key) { return iterator(tree, lower (key)); }
+  const_iterator lower_bound (const K& key) const { return const_iterator(tree, lower (key)); }
+  iterator upper_bound (const K& key) { return iterator(tree, upper (key)); }
+  const_iterator upper_bound (const K& key) const { return const_iterator(tree, upper (key)); }
+
+  std::pair<iterator, iterator> equal_range (const K& key)
+  {
+    return std::make_pair (lower_bound (key), upper_bound (key));
+  }
+
+  V& at (const K& key)
+  {
+    rbnode *x = search (key);
+    if (x == nil())
+      throw std::out_of_range ("rb::map::at");
+    return static_cast<node*>(x)->value.second;
+  }
+
+  const V& at (const K& key) const
+  {
+    rbnode *x = search (key);
+    if (x == nil())
+      throw std::out_of_range ("rb::map::at");
+    return static_cast<const node*>(x)->value.second;
+  }
+
+  V& operator[] (const K& key) { return try_emplace (key).first->second; }
+  V& operator[] (K&& key) { return try_emplace (std::move(key)).first->second; }
+
+  /* modifiers */
+
+  /* construct the element first, then look for its key (std::map does
+   * the same), the node is discarded if the key is already present.
+   */
+  template <class... Args>
+  std::pair<iterator, bool> emplace (Args&&... args)
+  {
+    rbnode *parent, *dup;
+    int res;
+
+    if (!tree)
+      tree = create();
+
+    node *x = new node(std::forward<Args>(args)...);
+    try {
+      dup = descend (x->value.first, &parent, &res);
+    }
+    catch (...) {
+      delete x;               /* the comparator threw, x was never linked */
+      throw;
+    }
+
+    if (dup != rbnil(tree)) {
+      delete x;
+      return std::make_pair (iterator(tree, dup), false);
+    }
+    return std::make_pair (iterator(tree, attach (parent, x, res)), true);
+  }
+
+  /* the hint is accepted for interface compatibility, the descent is
+   * always made from the root.
+   */
+  template <class... Args>
+  iterator emplace_hint (const_iterator, Args&&... args)
+  {
+    return emplace (std::forward<Args>(args)...).first;
+  }
+
+  /* only construct the value if key is absent, works with move-only V */
+  template <class KK, class... Args>
+  std::pair<iterator, bool> try_emplace (KK&& key, Args&&... args)
+  {
+    rbnode *parent;
+    int res;
+
+    if (!tree)
+      tree = create();
+
+    rbnode *dup = descend (key, &parent, &res);
+
+    if (dup != rbnil(tree))
+      return std::make_pair (iterator(tree, dup), false);
+
+    node *x = new node(std::piecewise_construct,
+                       std::forward_as_tuple (std::forward<KK>(key)),
+                       std::forward_as_tuple (std::forward<Args>(args)...));
+    return std::make_pair (iterator(tree, attach (parent, x, res)), true);
+  }
+
+  std::pair<iterator, bool> insert (const value_type& v) { return emplace (v); }
+  std::pair<iterator, bool> insert (value_type&& v) { return emplace (std::move(v)); }
+
+  template <class InputIt>
+  void insert (InputIt first, InputIt last)
+  {
+    for (; first != last; ++first)
+      emplace (*first);
+  }
+
+  iterator erase (const_iterator pos)
+  {
+    rbnode *x = pos.cur,
+           *next = rbsuccessor (tree, x);
+
+    rbunlink (tree, x);   /* next keeps its identity through the unlink */
+    delete static_cast<node*>(x);
+    n--;
+
+    return iterator(tree, next);
+  }
+
+  iterator erase (iterator pos) { return erase (const_iterator(pos)); }
+
+  iterator erase (const_iterator first, const_iterator last)
+  {
+    while (first != last)
+      first = erase (first);
+    return iterator(tree, last.cur);
+  }
+
+  size_type erase (const K& key)
+  {
+    rbnode *x = search (key);
+    if (x == nil())
+      return 0;
+    erase (const_iterator(tree, x));
+    return 1;
+  }
+
+  /* free every node post-order without rebalancing, then reset the root
+   * and the C tree's counts
+   */
+  void clear ()
+  {
+    if (!tree)
+      return;
+
+    rbnode *x = rbfirst(tree);
+
+    while (x != rbnil(tree)) {
+      if (x->left != rbnil(tree))
+        x = x->left;
+      else if (x->right != rbnil(tree))
+        x = x->right;
+      else {
+        rbnode *parent = x->parent;
+        if (parent != rbroot(tree)) {
+          if (parent->left == x)
+            parent->left = rbnil(tree);
+          else
+            parent->right = rbnil(tree);
+        }
+        delete static_cast<node*>(x);
+        x = parent == rbroot(tree) ? rbnil(tree) : parent;
+      }
+    }
+    rbfirst(tree) = rbnil(tree);
+    tree->count = tree->nuser = tree->ndead = 0;
+    n = 0;
+  }
+
+private:
+  static rbtree *create ()
+  {
+    rbtree *t = rbcreate (0);   /* compar is never called by the wrapper */
+    if (!t)
+      throw std::bad_alloc();
+    return t;
+  }
+
+  /* end of the tree, null while there is none */
+  rbnode *nil () const { return tree ? rbnil(tree) : 0; }
+
+  static const K& key_of (const rbnode *x)
+  {
+    return static_cast<const node*>(x)->value.first;
+  }
+
+  rbnode *search (const K& key) const
+  {
+    if (!tree)
+      return 0;
+
+    rbnode *x = rbfirst(tree);
+
+    while (x != rbnil(tree)) {
+      if (cmp (key, key_of (x)))
+        x = x->left;
+      else if (cmp (key_of (x), key))
+        x = x->right;
+      else
+        return x;
+    }
+    return x;
+  }
+
+  /* find key or the insertion point for it, returns nil if not found */
+  template <class KK>
+  rbnode *descend (const KK& key, rbnode **parent, int *res) const
+  {
+    rbnode *x = rbfirst(tree);
+
+    *parent = rbroot(tree);
+    *res = 0;
+
+    while (x != rbnil(tree)) {
+      *parent = x;
+      if (cmp (key, key_of (x))) {
+        *res = -1;
+        x = x->left;
+      }
+      else if (cmp (key_of (x), key)) {
+        *res = 1;
+        x = x->right;
+      }
+      else
+        return x;
+    }
+    return x;
+  }
+
+  rbnode *lower (const K& key) const
+  {
+    if (!tree)
+      return 0;
+
+    rbnode *x = rbfirst(tree),
+           *lb = rbnil(tree);
+
+    while (x != rbnil(tree)) {
+      if (cmp (key_of (x), key))
+        x = x->right;
+      else {
+        lb = x;
+        x = x->left;
+      }
+    }
+    return lb;
+  }
+
+  rbnode *upper (const K& key) const
+  {
+    if (!tree)
+      return 0;
+
+    rbnode *x = rbfirst(tree),
+           *ub = rbnil(tree);
+
+    while (x != rbnil(tree)) {
+      if (cmp (key, key_of (x))) {
+        ub = x;
+        x = x->left;
+      }
+      else
+        x = x->right;
+    }
+    return ub;
+  }
+
+  rbnode *attach (rbnode *parent, node *x, int res)
+  {
+    x->data = &x->value;    /* keeps rbapply() usable on the tree */
+    x->flags = rbuser;      /* the wrapper owns and deletes its nodes */
+    rblink (tree, parent, x, res);
+    n++;
+    return x;
+  }
+
+  rbtree *tree;
+  Compare cmp;
+  size_type n;
+};
+
+template <class K, class V, class C>
+inline void swap (map<K, V, C>& a, map<K, V, C>& b) { a.swap (b); }
+
+} /* namespace rb */
+
+#endif /* _REDBLACK_HPP */
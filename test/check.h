@@ -0,0 +1,75 @@
+/**
+ *  Scaffolding shared by the C checks: CHECK(), a seeded generator, an
+ *  int comparison and, with CHECK_WALK defined, an in-order walk against
+ *  an array model. Include after defining NKEYS (keys are 0 .. NKEYS - 1),
+ *  each program gets its own copy.
+ */
+
+#ifndef _CHECK_H
+#define _CHECK_H
+
+#include <stdio.h>
+
+static int failed;            /* checks failed, summed at exit */
+
+/* count a failed check in n, e.g. a worker thread's own count, summed
+ * into failed once the thread is joined
+ */
+#define CHECKN(n, c) \
+  do { \
+    if (!(c)) { \
+      fprintf (stderr, "%s:%d: check failed: %s\n", \
+               __FILE__, __LINE__, #c); \
+      (n)++; \
+    } \
+  } while (0)
+
+/* from the main thread only */
+#define CHECK(c)  CHECKN(failed, c)
+
+static unsigned long seed = 1;
+
+static int rnd (int n)
+{
+  seed = seed * 1103515245UL + 12345UL;
+
+  return (int)((seed >> 16) & 0x7fff) % n;
+}
+
+static int icompare (const void *a, const void *b)
+{
+  const int *x = a,
+            *y = b;
+
+  return (*x > *y) - (*x < *y);
+}
+
+#ifdef CHECK_WALK
+struct walk {
+  const int *model;
+  int next;                   /* smallest key not yet visited */
+};
+
+/* apply callback, each key must be the next one in the model */
+static int visit (void *data, void *cookie)
+{
+  struct walk *w = cookie;
+  int k = *(int *)data;
+
+  while (w->next < NKEYS && !w->model[w->next])
+    w->next++;
+  CHECK(k == w->next);
+  w->next = k + 1;
+
+  return 0;
+}
+
+/* after the walk: no key of the model may be left unvisited */
+static void visit_end (struct walk *w)
+{
+  for (; w->next < NKEYS; w->next++)
+    CHECK(!w->model[w->next]);
+}
+#endif
+
+#endif /* _CHECK_H */
@@ -0,0 +1,169 @@
+/**
+ *  Checks for rb::map: a random workload is run against std::map and the
+ *  contents compared after every step, then moves and a throwing
+ *  comparator are exercised.
+ *
+ *  build:  make test
+ *  usage:  ./test/rbmap-test
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "redblack.hpp"
+
+static int failed;
+
+#define CHECK(c) \
+  do { \
+    if (!(c)) { \
+      std::fprintf (stderr, "%s:%d: check failed: %s\n", \
+                    __FILE__, __LINE__, #c); \
+      failed++; \
+    } \
+  } while (0)
+
+template <class A, class B>
+static bool same (const A& a, const B& b)
+{
+  typename A::const_iterator i = a.begin();
+  typename B::const_iterator j = b.begin();
+
+  if (a.size() != b.size())
+    return false;
+  for (; i != a.end() && j != b.end(); ++i, ++j)
+    if (i->first != j->first || i->second != j->second)
+      return false;
+
+  return i == a.end() && j == b.end();
+}
+
+/* compare against std::map over random inserts, lookups and erases */
+static void model ()
+{
+  rb::map<int, int> m;
+  std::map<int, int> ref;
+  unsigned long r = 88172645463325252UL;
+  int i, k;
+
+  for (i = 0; i < 20000; i++) {
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    k = (int)(r % 512);
+
+    switch ((r >> 20) % 4) {
+    case 0:
+      CHECK(m.emplace (k, i).second == ref.emplace (k, i).second);
+      break;
+    case 1:
+      m[k] += i;
+      ref[k] += i;
+      break;
+    case 2:
+      CHECK(m.erase (k) == ref.erase (k));
+      break;
+    default:
+      CHECK(m.count (k) == ref.count (k));
+      CHECK((m.lower_bound (k) == m.end()) ==
+            (ref.lower_bound (k) == ref.end()));
+      if (m.lower_bound (k) != m.end())
+        CHECK(m.lower_bound (k)->first == ref.lower_bound (k)->first);
+      if (m.upper_bound (k) != m.end())
+        CHECK(m.upper_bound (k)->first == ref.upper_bound (k)->first);
+    }
+    if (i % 1000 == 0)
+      CHECK(same (m, ref));
+  }
+  CHECK(same (m, ref));
+
+  /* reverse iteration and erase by range */
+  CHECK(m.rbegin()->first == ref.rbegin()->first);
+  m.erase (m.lower_bound (100), m.lower_bound (200));
+  ref.erase (ref.lower_bound (100), ref.lower_bound (200));
+  CHECK(same (m, ref));
+}
+
+static_assert (std::is_nothrow_move_constructible<rb::map<int, int> >::value,
+               "moving a map must not allocate");
+static_assert (noexcept (std::declval<rb::map<int, int>&>().swap (
+                 std::declval<rb::map<int, int>&>())), "swap must not throw");
+
+/* a moved-from map is empty and fully usable */
+static void moves ()
+{
+  rb::map<int, std::string> a, c;
+  int i;
+
+  for (i = 0; i < 100; i++)
+    a.emplace (i, std::to_string (i));
+
+  rb::map<int, std::string> b(std::move (a));
+  CHECK(b.size() == 100 && b.at (42) == "42");
+  CHECK(a.empty() && a.begin() == a.end() && a.find (1) == a.end());
+  CHECK(a.count (1) == 0 && a.erase (1) == 0 && a.lower_bound (1) == a.end());
+  a.clear();
+  rb::map<int, std::string> d(a);
+  CHECK(d.empty() && d.begin() == d.end());
+  CHECK(a.try_emplace (7, "seven").second && a.size() == 1);
+
+  c = std::move (b);
+  CHECK(c.size() == 100);
+  CHECK(b.empty());
+  b.emplace (1, "one");
+  b = std::move (a);
+  CHECK(b.size() == 1 && b.at (7) == "seven");
+  a.emplace (2, "two");
+  CHECK(a.size() == 1);
+
+  rb::map<int, std::unique_ptr<int> > u;
+  u.try_emplace (1, new int(5));
+  CHECK(!u.try_emplace (1, std::unique_ptr<int>(new int(6))).second);
+  CHECK(*u.at (1) == 5);
+}
+
+/* comparator that throws once armed */
+struct touchy {
+  static bool armed;
+  bool operator() (int a, int b) const
+  {
+    if (armed)
+      throw std::runtime_error ("touchy");
+    return a < b;
+  }
+};
+bool touchy::armed = false;
+
+static void throwing ()
+{
+  rb::map<int, int, touchy> m;
+  bool thrown = false;
+
+  m.emplace (1, 1);
+  m.emplace (2, 2);
+  touchy::armed = true;
+  try {
+    m.emplace (3, 3);     /* the node built for 3 must be freed */
+  }
+  catch (const std::runtime_error&) {
+    thrown = true;
+  }
+  touchy::armed = false;
+
+  CHECK(thrown);
+  CHECK(m.size() == 2 && m.find (3) == m.end());
+}
+
+int main ()
+{
+  model();
+  moves();
+  throwing();
+
+  std::printf (" rbmap-test: %s\n", failed ? "FAILED" : "ok");
+
+  return failed != 0;
+}
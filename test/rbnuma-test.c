@@ -0,0 +1,135 @@
+/**
+ *  Checks for the NUMA replicated tree: random writes are compared against
+ *  an array model, the log must be trimmed once every replica has caught
+ *  up, and threads writing disjoint keys must all see their own writes.
+ *
+ *  build:  make test
+ *  usage:  ./test/rbnuma-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "rbnuma.h"
+
+#define NKEYS 4096            /* keys are 0 .. NKEYS - 1 */
+#define NTHREADS 4
+
+#ifndef RBNLOGMAX
+#define RBNLOGMAX 4096        /* as in rbnuma.c */
+#endif
+
+#include "check.h"
+
+/*
+ * Compare the local replica against the model.
+ */
+static void rbncheck (rbnuma *rn, const int *model)
+{
+  size_t n = 0;
+  int k;
+
+  for (k = 0; k < NKEYS; k++) {
+    n += model[k] != 0;
+    CHECK((rbnfind (rn, &k) != NULL) == (model[k] != 0));
+  }
+  CHECK(rbncount (rn) == n);
+}
+
+/*
+ * Random writes with nreplicas replicas, more than RBNLOGMAX of them so
+ * writers have to sync the replicas no thread uses.
+ */
+static void test_replicas (size_t nreplicas)
+{
+  rbnuma *rn = rbncreate (icompare, sizeof (int), nreplicas);
+  int model[NKEYS] = { 0 }, i, k;
+  void *data;
+
+  CHECK(rn != NULL);
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (2)) {
+      data = rbninsert (rn, &k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      model[k] = 1;
+    }
+    else {
+      data = rbndelete (rn, &k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      free (data);
+      model[k] = 0;
+    }
+    CHECK(rn->loglen <= RBNLOGMAX + 1);
+    if (i % 5000 == 0)
+      rbncheck (rn, model);
+  }
+  rbncheck (rn, model);
+
+  /* once every replica has caught up only the tail entry is left */
+  CHECK(rbnsync (rn) == 0);
+  CHECK(rn->loglen == 1);
+  rbncheck (rn, model);
+
+  rbndestroy (rn);
+}
+
+struct job {
+  rbnuma *rn;
+  int t,                      /* keys k with k % NTHREADS == t */
+      nfailed;                /* checks failed on this thread */
+};
+
+/* insert all own keys, delete the odd ones, look the rest up */
+static void *worker (void *arg)
+{
+  struct job *job = arg;
+  int k;
+
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    CHECKN(job->nfailed, rbninsert (job->rn, &k) == NULL);
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    if (k & 1)
+      free (rbndelete (job->rn, &k));
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    CHECKN(job->nfailed, (rbnfind (job->rn, &k) != NULL) == !(k & 1));
+
+  return NULL;
+}
+
+static void test_threads (void)
+{
+  rbnuma *rn = rbncreate (icompare, sizeof (int), 0);
+  pthread_t th[NTHREADS];
+  struct job jobs[NTHREADS];
+  int model[NKEYS], k;
+
+  for (k = 0; k < NTHREADS; k++) {
+    jobs[k].rn = rn;
+    jobs[k].t = k;
+    jobs[k].nfailed = 0;
+    pthread_create (th + k, NULL, worker, jobs + k);
+  }
+  for (k = 0; k < NTHREADS; k++) {
+    pthread_join (th[k], NULL);
+    failed += jobs[k].nfailed;
+  }
+
+  for (k = 0; k < NKEYS; k++)
+    model[k] = !(k & 1);
+  rbncheck (rn, model);
+
+  rbndestroy (rn);
+}
+
+int main (void)
+{
+  test_replicas (1);
+  test_replicas (4);
+  test_threads();
+
+  printf (" rbnuma-test: %s\n", failed ? "FAILED" : "ok");
+
+  return failed != 0;
+}
@@ -0,0 +1,193 @@
+/**
+ *  Checks for the sharded tree: range and hash partitioning are compared
+ *  against an array model, with many more shards than a rebalance can
+ *  fill, and threads inserting and deleting disjoint keys concurrently.
+ *
+ *  build:  make test
+ *  usage:  ./test/rbshard-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "rbshard.h"
+
+#define NKEYS 4096            /* keys are 0 .. NKEYS - 1 */
+#define NTHREADS 4
+#define CHECK_WALK
+
+#include "check.h"
+
+static size_t ihash (const void *a)
+{
+  return (size_t)(unsigned)*(const int *)a * 2654435761u;
+}
+
+/*
+ * Compare the whole tree against the model.
+ */
+static void rbscheck (rbshard *rs, const int *model)
+{
+  struct walk w;
+  size_t n = 0;
+  int k;
+
+  for (k = 0; k < NKEYS; k++) {
+    n += model[k] != 0;
+    CHECK((rbsfind (rs, &k) != NULL) == (model[k] != 0));
+  }
+  CHECK(rbscount (rs) == n);
+
+  w.model = model;
+  w.next = 0;
+  CHECK(rbsapply (rs, visit, &w) == 0);
+  visit_end (&w);
+}
+
+/*
+ * Ascending inserts overfill one range shard and force rebalances, with
+ * nshards both below and above the number of keys moved.
+ */
+static void test_range (size_t nshards)
+{
+  rbshard *rs = rbscreate (icompare, nshards, NULL, sizeof (int));
+  int model[NKEYS] = { 0 }, i, k;
+  void *data;
+
+  for (k = 0; k < NKEYS; k++) {
+    CHECK(rbsinsert (rs, &k, sizeof k) == NULL);
+    model[k] = 1;
+  }
+  rbscheck (rs, model);
+  CHECK(rbsrebalance (rs) == 0);
+
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (2)) {
+      data = rbsinsert (rs, &k, sizeof k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      model[k] = 1;
+    }
+    else {
+      data = rbsdelete (rs, &k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      free (data);
+      model[k] = 0;
+    }
+  }
+  rbscheck (rs, model);
+
+  rbsdestroy (rs, free);
+}
+
+/* an item whose bound is too big to copy on the stack, key first */
+struct wide {
+  int key;
+  char pad[124];
+};
+
+/*
+ * Range shards with large bounds, routed through heap copies.
+ */
+static void test_wide_bounds (void)
+{
+  static struct wide items[NKEYS];
+  rbshard *rs = rbscreate (icompare, 16, NULL, sizeof *items);
+  int k, found = 0;
+
+  for (k = 0; k < NKEYS; k++) {
+    items[k].key = k;
+    CHECK(rbsinsert (rs, items + k, 0) == NULL);
+  }
+  for (k = 0; k < NKEYS; k++)
+    found += rbsfind (rs, &k) == items + k;
+  CHECK(found == NKEYS && rbscount (rs) == NKEYS);
+
+  rbsdestroy (rs, NULL);
+}
+
+static void test_hash (void)
+{
+  rbshard *rs = rbscreate (icompare, 16, ihash, 0);
+  int model[NKEYS] = { 0 }, i, k;
+  void *data;
+
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (2)) {
+      data = rbsinsert (rs, &k, sizeof k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      model[k] = 1;
+    }
+    else {
+      free (rbsdelete (rs, &k));
+      model[k] = 0;
+    }
+  }
+  rbscheck (rs, model);
+
+  rbsdestroy (rs, free);
+}
+
+struct job {
+  rbshard *rs;
+  int t,                      /* keys k with k % NTHREADS == t */
+      nfailed;                /* checks failed on this thread */
+};
+
+/* insert all own keys, delete the odd ones, look the rest up */
+static void *worker (void *arg)
+{
+  struct job *job = arg;
+  int k;
+
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    CHECKN(job->nfailed, rbsinsert (job->rs, &k, sizeof k) == NULL);
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    if (k & 1)
+      free (rbsdelete (job->rs, &k));
+  for (k = job->t; k < NKEYS; k += NTHREADS)
+    CHECKN(job->nfailed, (rbsfind (job->rs, &k) != NULL) == !(k & 1));
+
+  return NULL;
+}
+
+static void test_threads (void)
+{
+  rbshard *rs = rbscreate (icompare, 8, NULL, sizeof (int));
+  pthread_t th[NTHREADS];
+  struct job jobs[NTHREADS];
+  int model[NKEYS], k;
+
+  for (k = 0; k < NTHREADS; k++) {
+    jobs[k].rs = rs;
+    jobs[k].t = k;
+    jobs[k].nfailed = 0;
+    pthread_create (th + k, NULL, worker, jobs + k);
+  }
+  for (k = 0; k < NTHREADS; k++) {
+    pthread_join (th[k], NULL);
+    failed += jobs[k].nfailed;
+  }
+
+  for (k = 0; k < NKEYS; k++)
+    model[k] = !(k & 1);
+  rbscheck (rs, model);
+
+  rbsdestroy (rs, free);
+}
+
+int main (void)
+{
+  test_range (1);
+  test_range (64);
+  test_range (2048);
+  test_wide_bounds();
+  test_hash();
+  test_threads();
+
+  printf (" rbshard-test: %s\n", failed ? "FAILED" : "ok");
+
+  return failed != 0;
+}
@@ -0,0 +1,1250 @@
+/**
+ *  Checks for the rbtree core: after every batch of random operations the
+ *  redblack rules, parent links, key order and node count are verified and
+ *  the contents compared against a plain array model of the keys.
+ *
+ *  build:  make test
+ *  usage:  ./test/rbtree-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "redblack.h"
+
+#define NKEYS 1024            /* keys are 0 .. NKEYS - 1 */
+
+#include "check.h"
+
+/*
+ * Black height of the subtree at node after checking, in it, the redblack
+ * rules, the parent links and that every key lies between lo and hi
+ * (NULL for no bound). *n counts the nodes seen.
+ */
+static int rbcheck_node (rbtree *tree, rbnode *node, rbnode *parent,
+                         const void *lo, const void *hi, size_t *n)
+{
+  int lh, rh;
+
+  if (node == rbnil(tree))
+    return 1;
+
+  (*n)++;
+  CHECK(node->parent == parent);
+  CHECK(node->color == red || node->color == black);
+  if (node->color == red)
+    CHECK(node->left->color == black && node->right->color == black);
+  CHECK(!lo || tree->compar (lo, node->data) < 0);
+  CHECK(!hi || tree->compar (node->data, hi) < 0);
+  if (tree->prefix)
+    CHECK(node->prefix == tree->prefix (node->data));
+
+  lh = rbcheck_node (tree, node->left, node, lo, node->data, n);
+  rh = rbcheck_node (tree, node->right, node, node->data, hi, n);
+  CHECK(lh == rh);
+
+  /* interval mode, aug holds the largest high endpoint below node */
+  if (tree->high) {
+    const void *max = tree->high (node->data);
+
+    if (node->left != rbnil(tree) &&
+        tree->epcmp (tree->high (node->left->aug), max) > 0)
+      max = tree->high (node->left->aug);
+    if (node->right != rbnil(tree) &&
+        tree->epcmp (tree->high (node->right->aug), max) > 0)
+      max = tree->high (node->right->aug);
+    CHECK(tree->epcmp (tree->high (node->aug), max) == 0);
+  }
+
+  /* aggregate mode, aug is left . node . right */
+  if (tree->combine) {
+    unsigned char want[64], one[64];
+
+    CHECK(tree->aggsz <= sizeof want);
+    memcpy (want, node->left != rbnil(tree) ? node->left->aug : tree->aggbuf,
+            tree->aggsz);
+    tree->value (node, one);
+    tree->combine (want, want, one);
+    if (node->right != rbnil(tree))
+      tree->combine (want, want, node->right->aug);
+    CHECK(memcmp (want, node->aug, tree->aggsz) == 0);
+  }
+
+  return lh + (node->color == black);
+}
+
+/*
+ * Check the whole tree structure.
+ */
+static void rbcheck (rbtree *tree)
+{
+  size_t n = 0;
+
+  CHECK(rbnil(tree)->color == black);
+  CHECK(rbfirst(tree)->color == black);
+  rbcheck_node (tree, rbfirst(tree), rbroot(tree), NULL, NULL, &n);
+  CHECK(n == tree->count);
+}
+
+/*
+ * Check the live keys of tree, walked in order, against the model, which
+ * is non-zero for every key present.
+ */
+static void rbcheck_model (rbtree *tree, const int *model)
+{
+  rbnode *node = rbmin (tree);
+  size_t n = 0;
+  int k;
+
+  for (k = 0; k < NKEYS; k++) {
+    if (!model[k])
+      continue;
+    n++;
+    CHECK(node != rbnil(tree));
+    if (node == rbnil(tree))
+      return;
+    CHECK(*(int *)node->data == k);
+    node = rbsuccessor (tree, node);
+  }
+  CHECK(node == rbnil(tree));
+  CHECK(rbsize(tree) == n);
+}
+
+/*
+ * Random inserts, finds and deletes with internal storage.
+ */
+static void test_basic (void)
+{
+  rbtree *tree = rbcreate (icompare);
+  int model[NKEYS] = { 0 }, i, k;
+  rbnode *node;
+
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS);
+    node = rbfind (tree, &k);
+    CHECK((node != NULL) == (model[k] != 0));
+
+    if (rnd (3)) {
+      node = rbinsert (tree, &k, sizeof k);
+      CHECK(model[k] ? node && *(int *)node->data == k : node == NULL);
+      model[k] = 1;
+    }
+    else if (node) {
+      free (rbdelete (tree, node));
+      model[k] = 0;
+    }
+    if (i % 500 == 0) {
+      rbcheck (tree);
+      rbcheck_model (tree, model);
+    }
+  }
+  rbcheck (tree);
+  rbcheck_model (tree, model);
+
+  node = rbmax (tree);
+  for (k = NKEYS - 1; k >= 0 && !model[k]; k--)
+    ;
+  CHECK(node != rbnil(tree) && *(int *)node->data == k);
+
+  rbdestroy (tree, free);
+}
+
+/* caller-owned object with an embedded node, the key leads */
+struct obj {
+  int key;
+  rbnode link;
+};
+
+/*
+ * Intrusive nodes are linked and unlinked but never allocated or freed.
+ */
+static void test_intrusive (void)
+{
+  static struct obj objs[NKEYS];
+  rbtree *tree = rbcreate (icompare);
+  int model[NKEYS] = { 0 }, i, k;
+  rbnode *node;
+  struct obj dup;
+
+  for (i = 0; i < NKEYS; i++) {
+    objs[i].key = i;
+    objs[i].link.data = objs + i;
+  }
+
+  for (i = 0; i < 4000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (2)) {
+      node = rbinsert_node (tree, &objs[k].link);
+      CHECK(model[k] ? node == &objs[k].link : node == NULL);
+      model[k] = 1;
+    }
+    else if ((node = rbfind (tree, &k))) {
+      CHECK(rbentry(node, struct obj, link) == objs + k);
+      CHECK(node->flags & rbuser);
+      CHECK(rbdelete (tree, node) == objs + k);
+      model[k] = 0;
+    }
+  }
+  rbcheck (tree);
+  rbcheck_model (tree, model);
+
+  /* a second object with a key already present is turned away */
+  for (k = 0; !model[k]; k++)
+    ;
+  dup.key = k;
+  dup.link.data = &dup;
+  CHECK(rbinsert_node (tree, &dup.link) == &objs[k].link);
+
+  /* destroy leaves the objects alone, they are not heap memory */
+  rbdestroy (tree, NULL);
+  for (i = 0; i < NKEYS; i++)
+    CHECK(objs[i].key == i);
+}
+
+#define TOPK 64
+
+static int nevicted;
+
+static void evicted (void *data)
+{
+  (void)data;
+  nevicted++;
+}
+
+/*
+ * A bounded tree keeps the TOPK largest keys of a random stream, checked
+ * against the model after every insert.
+ */
+static void test_capacity (void)
+{
+  rbtree *tree = rbcreate (icompare);
+  int model[NKEYS] = { 0 }, keys[NKEYS], i, k, n = 0, min;
+  struct obj o;
+  rbnode *node;
+
+  CHECK(rbsetcapacity (tree, TOPK, NULL) == 0);
+  for (i = 0; i < 10000; i++) {
+    k = rnd (NKEYS);
+    for (min = 0; min < NKEYS && !model[min]; min++)
+      ;
+    node = rbinsert (tree, &k, sizeof k);
+    if (model[k]) {
+      CHECK(node && node != rbnil(tree) && *(int *)node->data == k);
+    }
+    else if (n == TOPK && k < min) {
+      CHECK(node == rbnil(tree));
+    }
+    else {
+      CHECK(node == NULL);
+      model[k] = 1;
+      if (n == TOPK)
+        model[min] = 0;
+      else
+        n++;
+    }
+    if (i % 500 == 0)
+      rbcheck (tree);
+    rbcheck_model (tree, model);
+  }
+  CHECK(rbsize(tree) == TOPK);
+
+  /* caller-owned nodes would grow it past capacity */
+  o.key = NKEYS;
+  o.link.data = &o;
+  CHECK(rbinsert_node (tree, &o.link) == rbnil(tree));
+  CHECK(rbsize(tree) == TOPK && !rbfind (tree, &o.key));
+  CHECK(rbsetcapacity (tree, TOPK / 2, NULL) == -1);
+  rbdestroy (tree, free);
+
+  /* external storage, every eviction hands the old data to evict */
+  tree = rbcreate (icompare);
+  CHECK(rbsetcapacity (tree, TOPK, evicted) == 0);
+  for (k = 0; k < NKEYS; k++) {
+    keys[k] = k;
+    CHECK(rbinsert (tree, keys + k, 0) == NULL);
+  }
+  CHECK(nevicted == NKEYS - TOPK);
+  CHECK(*(int *)rbmin (tree)->data == NKEYS - TOPK);
+  rbcheck (tree);
+  rbdestroy (tree, NULL);
+}
+
+static int nreaped;
+
+static void reaped (void *data)
+{
+  free (data);
+  nreaped++;
+}
+
+/*
+ * Lazy deletes, revivals and purges, explicit and automatic, against a
+ * model that tracks dead nodes still linked as well as live ones.
+ */
+static void test_lazy (void)
+{
+  rbtree *tree = rbcreate (icompare);
+  int model[NKEYS] = { 0 }, dead[NKEYS] = { 0 }, i, k, nlive = 0, ndead = 0,
+      *ext;
+  struct obj *o;
+  rbnode *node;
+
+  CHECK(rbsetpurge (tree, 101, reaped) == -1);
+  CHECK(rbsetpurge (tree, 0, reaped) == 0);
+
+  for (i = 0; i < 20000; i++) {
+    if (i == 10000)
+      CHECK(rbsetpurge (tree, 30, reaped) == 0);
+    k = rnd (NKEYS);
+    node = rbfind (tree, &k);
+    CHECK((node != NULL) == (model[k] != 0));
+
+    if (rnd (2)) {
+      node = rbinsert (tree, &k, sizeof k);
+      CHECK(model[k] ? node && *(int *)node->data == k : node == NULL);
+      if (!model[k]) {
+        nlive++;
+        ndead -= dead[k];
+        dead[k] = 0;
+      }
+      model[k] = 1;
+    }
+    else if (node) {
+      CHECK(rbdelete_lazy (tree, node) == 0);
+      /* the node is still linked unless an automatic purge took it */
+      if (i < 10000)
+        CHECK(rbdelete_lazy (tree, node) == -1);
+      model[k] = 0;
+      dead[k] = 1;
+      nlive--;
+      ndead++;
+      /* the automatic purge, when on, reaps every dead node */
+      if (i >= 10000 && ndead * 100 >= 30 * (nlive + ndead)) {
+        nreaped -= ndead;
+        ndead = 0;
+        for (k = 0; k < NKEYS; k++)
+          dead[k] = 0;
+      }
+    }
+    CHECK(tree->ndead == (size_t)ndead);
+    CHECK(rbsize(tree) == (size_t)nlive);
+
+    if (i % 2000 == 0) {
+      rbcheck (tree);
+      rbcheck_model (tree, model);
+    }
+    if (i % 5000 == 4999) {
+      CHECK(rbpurge (tree) == (size_t)ndead);
+      nreaped -= ndead;
+      ndead = 0;
+      for (k = 0; k < NKEYS; k++)
+        dead[k] = 0;
+      CHECK(tree->count == (size_t)nlive);
+      rbcheck (tree);
+      rbcheck_model (tree, model);
+    }
+  }
+  CHECK(nreaped == 0);
+  rbdestroy (tree, free);
+
+  /* a dead caller-owned node is reaped, not revived, by rbinsert(), with
+   * internal and with external storage
+   */
+  tree = rbcreate (icompare);
+  CHECK(rbsetpurge (tree, 0, reaped) == 0);
+  for (i = 0; i < 2; i++) {
+    o = malloc (sizeof *o);
+    ext = malloc (sizeof *ext);
+    o->key = *ext = k = 7;
+    o->link.data = o;
+    CHECK(rbinsert_node (tree, &o->link) == NULL);
+    CHECK(rbdelete_lazy (tree, &o->link) == 0);
+    nreaped = 0;
+    if (i) {
+      CHECK(rbinsert (tree, ext, 0) == NULL);
+    }
+    else {
+      CHECK(rbinsert (tree, &k, sizeof k) == NULL);
+      free (ext);
+    }
+    CHECK(nreaped == 1);
+    node = rbfind (tree, &k);
+    CHECK(node && !(node->flags & (rbuser | rbdead)));
+    CHECK(node && *(int *)node->data == 7);
+    CHECK(tree->nuser == 0 && tree->ndead == 0 && rbsize(tree) == 1);
+    rbcheck (tree);
+    free (rbdelete (tree, node));
+  }
+  rbdestroy (tree, free);
+}
+
+static int nfreed;
+
+/* runs on the worker thread, read only after rbdestroy_wait() */
+static void countfree (void *data)
+{
+  free (data);
+  nfreed++;
+}
+
+/*
+ * Trees handed to rbdestroy_async() have every item destroyed once
+ * rbdestroy_wait() returns, queued or destroyed in the caller.
+ */
+static void test_async (void)
+{
+  rbtree *tree;
+  int t, k;
+
+  for (t = 0; t < 8; t++) {
+    tree = rbcreate (icompare);
+    for (k = 0; k < NKEYS; k++)
+      rbinsert (tree, &k, sizeof k);
+    CHECK(rbdestroy_async (tree, countfree) >= 0);
+  }
+  rbdestroy_wait ();
+  CHECK(nfreed == 8 * NKEYS);
+}
+
+/*
+ * Percentiles of a hand-made histogram, and with -DRBSTATS one histogram
+ * per operation.
+ */
+static void test_stats (void)
+{
+  static rbhist h;
+  rbtree *tree = rbcreate (icompare);
+  struct obj o;
+  rbnode *node;
+  int k;
+
+  /* one operation each of 1, 2 and 3 ns */
+  h.count = 3;
+  h.total = 6;
+  h.max = 3;
+  h.bucket[1] = h.bucket[2] = h.bucket[3] = 1;
+  CHECK(rbstats_percentile (&h, 0) == 1);
+  CHECK(rbstats_percentile (&h, 33) == 1);
+  CHECK(rbstats_percentile (&h, 50) == 2);
+  CHECK(rbstats_percentile (&h, 67) == 3);
+  CHECK(rbstats_percentile (&h, 100) == 3);
+
+  rbstats_reset ();
+  for (k = 0; k < 10; k++)
+    rbinsert (tree, &k, sizeof k);
+  o.key = 10;
+  o.link.data = &o;
+  rbinsert_node (tree, &o.link);
+  for (k = 0; k < 4; k++)
+    rbdelete_lazy (tree, rbfind (tree, &k));
+  node = rbfind (tree, &k);
+  free (rbdelete (tree, node));
+
+  rbstats_get (rbstat_insert, &h);
+#ifdef RBSTATS
+  CHECK(h.count == 10);
+  rbstats_get (rbstat_insert_node, &h);
+  CHECK(h.count == 1);
+  rbstats_get (rbstat_find, &h);
+  CHECK(h.count == 5);
+  rbstats_get (rbstat_delete_lazy, &h);
+  CHECK(h.count == 4);
+  rbstats_get (rbstat_delete, &h);
+  CHECK(h.count == 1);
+  rbstats_reset ();
+  rbstats_get (rbstat_insert, &h);
+#endif
+  CHECK(h.count == 0 && h.total == 0 && h.max == 0);
+
+  CHECK(rbdelete (tree, &o.link) == &o);
+  rbdestroy (tree, free);
+}
+
+static int scompare (const void *a, const void *b)
+{
+  return strcmp (a, b);
+}
+
+/*
+ * Inline prefixes, with keys that differ inside the prefix and keys that
+ * all share it so compar breaks the ties.
+ */
+static void test_prefix (void)
+{
+  static char keys[2 * NKEYS][16];
+  rbtree *tree = rbcreate (scompare);
+  int model[2 * NKEYS] = { 0 }, i, k;
+  rbnode *node;
+
+  CHECK(rbsetprefix (tree, rbprefix_str) == 0);
+  for (i = 0; i < NKEYS; i++) {
+    sprintf (keys[i], "%04d", i);
+    sprintf (keys[NKEYS + i], "prefix--%04d", i);
+  }
+
+  /* the prefix keeps the strcmp() order */
+  for (i = 0; i < 1000; i++) {
+    char *a = keys[rnd (2 * NKEYS)], *b = keys[rnd (2 * NKEYS)];
+
+    if (rbprefix_str (a) < rbprefix_str (b))
+      CHECK(strcmp (a, b) < 0);
+  }
+
+  for (i = 0; i < 20000; i++) {
+    k = rnd (2 * NKEYS);
+    node = rbfind (tree, keys[k]);
+    CHECK((node != NULL) == (model[k] != 0));
+    if (rnd (3)) {
+      node = rbinsert (tree, keys[k], strlen (keys[k]) + 1);
+      CHECK(model[k] ? node && !strcmp (node->data, keys[k]) : node == NULL);
+      model[k] = 1;
+    }
+    else if (node) {
+      free (rbdelete (tree, node));
+      model[k] = 0;
+    }
+  }
+  rbcheck (tree);
+  for (k = 0; k < 2 * NKEYS; k++)
+    CHECK((rbfind (tree, keys[k]) != NULL) == (model[k] != 0));
+
+  /* no prefix function once the tree has nodes */
+  CHECK(rbsize(tree) == 0 || rbsetprefix (tree, NULL) == -1);
+
+  rbdestroy (tree, free);
+}
+
+/* relocation callback, keeps the node handles in cookie current */
+static void relocated (rbnode *old, rbnode *new, void *cookie)
+{
+  rbnode **handle = cookie;
+  int k = *(int *)new->data;
+
+  CHECK(handle[k] == old);
+  handle[k] = new;
+}
+
+/* destructor for a tree mixing heap data with the static objs */
+static void ifree_owned (void *data)
+{
+  if (*(int *)data % 8)
+    free (data);
+}
+
+/*
+ * Compaction in steps between inserts and deletes, with caller-owned
+ * nodes that must stay put, then reuse of slab slots and rbreplace().
+ */
+static void test_compact (void)
+{
+  static struct obj objs[NKEYS];
+  static rbnode *handle[NKEYS];
+  rbtree *tree = rbcreate (icompare);
+  int model[NKEYS] = { 0 }, i, k, ret = 0;
+  rbnode *node, *spare;
+
+  rbsetrelocate (tree, relocated, handle);
+
+  /* every eighth key is a caller-owned node, the rest tree-owned */
+  for (k = 0; k < NKEYS; k++) {
+    if (k % 8 == 0) {
+      objs[k].key = k;
+      objs[k].link.data = objs + k;
+      CHECK(rbinsert_node (tree, &objs[k].link) == NULL);
+    }
+    else {
+      CHECK(rbinsert (tree, &k, sizeof k) == NULL);
+    }
+    handle[k] = rbfind (tree, &k);
+    model[k] = 1;
+  }
+
+  /* churn the tree-owned keys while compacting a little at a time */
+  for (i = 0; i < 20000; i++) {
+    if ((k = rnd (NKEYS)) % 8 == 0)
+      continue;
+    if (model[k]) {
+      free (rbdelete (tree, handle[k]));
+      model[k] = 0;
+    }
+    else {
+      CHECK(rbinsert (tree, &k, sizeof k) == NULL);
+      handle[k] = rbfind (tree, &k);
+      model[k] = 1;
+    }
+    if (i % 7 == 0)
+      CHECK((ret = rbcompact_step (tree, 16)) >= 0);
+    if (i % 1000 == 0)
+      rbcheck (tree);
+  }
+  while (ret == 1)
+    CHECK((ret = rbcompact_step (tree, 64)) >= 0);
+  rbcheck (tree);
+  rbcheck_model (tree, model);
+
+  /* a full pass puts every tree-owned node in the slab */
+  CHECK(rbcompact (tree) == 0);
+  rbcheck (tree);
+  rbcheck_model (tree, model);
+  for (k = 0; k < NKEYS; k++) {
+    if (!model[k])
+      continue;
+    node = rbfind (tree, &k);
+    CHECK(node == handle[k]);
+    if (k % 8 == 0)
+      CHECK(node == &objs[k].link && !(node->flags & rbinslab));
+    else
+      CHECK(node->flags & rbinslab);
+  }
+
+  /* a slot freed by a delete is the next insert's node */
+  for (k = 1; !model[k] || k % 8 == 0; k++)
+    ;
+  node = handle[k];
+  free (rbdelete (tree, node));
+  CHECK(rbinsert (tree, &k, sizeof k) == NULL);
+  CHECK(rbfind (tree, &k) == node && (node->flags & rbinslab));
+
+  /* slab nodes cannot be handed back by rbreplace(), heap nodes can */
+  spare = malloc (sizeof *spare);
+  CHECK(rbreplace (tree, node, spare) == NULL);
+  CHECK(rbfind (tree, &k) == node);
+  for (k = 1; model[k] || k % 8 == 0; k++)
+    ;
+  CHECK(rbinsert (tree, &k, sizeof k) == NULL);
+  node = rbfind (tree, &k);
+  CHECK(!(node->flags & rbinslab));
+  CHECK(rbreplace (tree, node, spare) == node);
+  CHECK(spare->flags == 0 && rbfind (tree, &k) == spare);
+  free (node);
+  rbcheck (tree);
+
+  rbdestroy (tree, ifree_owned);
+}
+
+/* closed interval, ordered by lo then hi */
+struct ival {
+  int lo, hi;
+};
+
+#define IVLEN 16              /* lengths are 0 .. IVLEN - 1 */
+#define IVMAX 512             /* low endpoints are 0 .. IVMAX - 1 */
+
+static int ivcompare (const void *a, const void *b)
+{
+  const struct ival *x = a,
+                    *y = b;
+
+  if (x->lo != y->lo)
+    return (x->lo > y->lo) - (x->lo < y->lo);
+
+  return (x->hi > y->hi) - (x->hi < y->hi);
+}
+
+static const void *ivlow (const void *a)
+{
+  return &((const struct ival *)a)->lo;
+}
+
+static const void *ivhigh (const void *a)
+{
+  return &((const struct ival *)a)->hi;
+}
+
+struct ivquery {
+  int lo, hi, n;
+  struct ival last;           /* previous interval reported */
+};
+
+/* rbinterval_overlaps() callback, checks overlap and order */
+static int ivvisit (void *data, void *cookie)
+{
+  struct ival *iv = data;
+  struct ivquery *q = cookie;
+
+  CHECK(iv->lo <= q->hi && q->lo <= iv->hi);
+  CHECK(q->n == 0 || ivcompare (&q->last, iv) < 0);
+  q->last = *iv;
+  q->n++;
+
+  return 0;
+}
+
+/*
+ * Check that b has the shape, colors and keys of a, in separate nodes.
+ */
+static void rbsame (rbtree *a, rbnode *x, rbtree *b, rbnode *y)
+{
+  if (x == rbnil(a) || y == rbnil(b)) {
+    CHECK(x == rbnil(a) && y == rbnil(b));
+    return;
+  }
+  CHECK(x != y && x->color == y->color);
+  CHECK(*(int *)x->data == *(int *)y->data);
+  rbsame (a, x->left, b, y->left);
+  rbsame (a, x->right, b, y->right);
+}
+
+static void *icopy (const void *data)
+{
+  int *p = malloc (sizeof *p);
+
+  if (p)
+    *p = *(const int *)data;
+
+  return p;
+}
+
+static int ncopies,              /* copies icopy_few() made, not freed */
+           copyleft;             /* copies it may still make */
+
+static void *icopy_few (const void *data)
+{
+  if (copyleft-- <= 0)
+    return NULL;
+  ncopies++;
+
+  return icopy (data);
+}
+
+static void ifree_few (void *data)
+{
+  ncopies--;
+  free (data);
+}
+
+#define NBIG 70000            /* past RBCLONE_PARALLEL */
+
+/*
+ * Clones of random and of large trees, with internal storage, a copy
+ * function and shared data, must match the source and stay independent.
+ */
+static void test_clone (void)
+{
+  rbtree *tree = rbcreate (icompare), *clone;
+  int model[NKEYS] = { 0 }, *keys, i, k;
+  rbnode *handle[NKEYS], *node;
+
+  for (i = 0; i < 4000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (3)) {
+      rbinsert (tree, &k, sizeof k);
+      model[k] = 1;
+    }
+    else if ((node = rbfind (tree, &k))) {
+      free (rbdelete (tree, node));
+      model[k] = 0;
+    }
+  }
+  rbsetrelocate (tree, relocated, handle);
+  CHECK(rbsetpurge (tree, 0, free) == 0);
+
+  clone = rbclone (tree, NULL, NULL, sizeof k);
+  CHECK(clone != NULL);
+  rbcheck (clone);
+  rbcheck_model (clone, model);
+  rbsame (tree, rbfirst(tree), clone, rbfirst(clone));
+  CHECK(!clone->relocate && !clone->rcookie && clone->reap == free);
+
+  /* changes to the clone leave the source alone */
+  for (k = 0; k < NKEYS; k++)
+    if ((node = rbfind (clone, &k)))
+      free (rbdelete (clone, node));
+  rbcheck (clone);
+  CHECK(rbsize(clone) == 0);
+  rbcheck_model (tree, model);
+  rbdestroy (clone, free);
+
+  clone = rbclone (tree, icopy, free, 0);
+  CHECK(clone != NULL);
+  rbsame (tree, rbfirst(tree), clone, rbfirst(clone));
+  rbdestroy (clone, free);
+
+  /* a copy() failing part-way gets the copies made before it released */
+  copyleft = (int)rbsize(tree) / 2;
+  ncopies = 0;
+  CHECK(rbclone (tree, icopy_few, ifree_few, 0) == NULL && ncopies == 0);
+
+  /* shared data must not reach the source's destructors from the clone */
+  clone = rbclone (tree, NULL, NULL, 0);
+  CHECK(clone != NULL);
+  rbsame (tree, rbfirst(tree), clone, rbfirst(clone));
+  CHECK(!clone->reap && !clone->evict);
+  rbdestroy (clone, NULL);
+  rbdestroy (tree, free);
+
+  /* big enough for the threaded path */
+  if (!(keys = malloc (NBIG * sizeof *keys))) {
+    perror ("malloc-keys");
+    failed++;
+    return;
+  }
+  tree = rbcreate (icompare);
+  for (i = 0; i < NBIG; i++) {
+    keys[i] = i;
+    rbinsert (tree, keys + i, 0);
+  }
+  clone = rbclone (tree, NULL, NULL, sizeof *keys);
+  CHECK(clone != NULL);
+  rbcheck (clone);
+  rbsame (tree, rbfirst(tree), clone, rbfirst(clone));
+  for (i = 0, node = rbmin (clone); node != rbnil(clone);
+       node = rbsuccessor (clone, node), i++)
+    CHECK(*(int *)node->data == i && node->data != keys + i);
+  CHECK(i == NBIG);
+  rbdestroy (clone, free);
+  rbdestroy (tree, NULL);
+  free (keys);
+}
+
+#define NHUGE 300000          /* past RBFLATTEN_PARALLEL */
+
+/*
+ * rbflatten() and rbflatten_range() output against the model, with dead
+ * nodes left in the tree, and rbload() of that output.
+ */
+static void test_flatten (void)
+{
+  rbtree *tree = rbcreate (icompare), *copy;
+  int model[NKEYS] = { 0 }, keys[NKEYS], *big, *out, i, k, n, lo, hi, *plo,
+      *phi;
+  void *data[NKEYS], **outp, *swap;
+  rbnode *node;
+  size_t m;
+
+  for (i = 0; i < 4000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (3)) {
+      rbinsert (tree, &k, sizeof k);
+      model[k] = 1;
+    }
+    else if ((node = rbfind (tree, &k))) {
+      rbdelete_lazy (tree, node);
+      model[k] = 0;
+    }
+  }
+  CHECK(tree->ndead > 0);
+
+  m = rbflatten (tree, keys, sizeof *keys, data, NKEYS);
+  CHECK(m == rbsize(tree));
+  for (n = 0, k = 0; k < NKEYS; k++) {
+    if (model[k]) {
+      CHECK(keys[n] == k && *(int *)data[n] == k);
+      n++;
+    }
+  }
+
+  /* a short array takes the first n items */
+  CHECK(rbflatten (tree, keys, sizeof *keys, NULL, 10) == 10);
+  for (n = 0, k = 0; n < 10; k++)
+    if (model[k])
+      CHECK(keys[n++] == k);
+
+  for (i = 0; i < 500; i++) {
+    lo = rnd (NKEYS);
+    hi = lo + rnd (NKEYS / 4) - NKEYS / 32;
+    plo = rnd (8) ? &lo : NULL;
+    phi = rnd (8) ? &hi : NULL;
+    m = rbflatten_range (tree, plo, phi, keys, sizeof *keys, NULL, NKEYS);
+    for (n = 0, k = 0; k < NKEYS; k++) {
+      if (model[k] && (!plo || k >= lo) && (!phi || k <= hi)) {
+        CHECK((size_t)n < m && keys[n] == k);
+        n++;
+      }
+    }
+    CHECK(m == (size_t)n);
+  }
+
+  /* and back, into a perfectly balanced tree of its own nodes */
+  m = rbflatten (tree, NULL, 0, data, NKEYS);
+  copy = rbcreate (icompare);
+  CHECK(rbload (copy, data, m, sizeof k) == 0);
+  rbcheck (copy);
+  rbcheck_model (copy, model);
+  CHECK(rbload (copy, data, m, sizeof k) == -1);
+  rbdestroy (copy, free);
+
+  copy = rbcreate (icompare);
+  swap = data[0];
+  data[0] = data[1];
+  data[1] = swap;
+  CHECK(m < 2 || rbload (copy, data, m, sizeof k) == -1);
+  CHECK(rbsize(copy) == 0);
+  rbdestroy (copy, free);
+  rbdestroy (tree, free);
+
+  /* big enough for the threaded path, external storage */
+  big = malloc (NHUGE * sizeof *big);
+  out = malloc (NHUGE * sizeof *out);
+  outp = malloc (NHUGE * sizeof *outp);
+  if (!big || !out || !outp) {
+    perror ("malloc-big");
+    failed++;
+    free (big);
+    free (out);
+    free (outp);
+    return;
+  }
+  tree = rbcreate (icompare);
+  for (i = 0; i < NHUGE; i++) {
+    big[i] = i;
+    rbinsert (tree, big + i, 0);
+  }
+  for (i = 0; i < NHUGE; i += 7)
+    rbdelete_lazy (tree, rbfind (tree, big + i));
+
+  m = rbflatten (tree, out, sizeof *out, outp, NHUGE);
+  CHECK(m == rbsize(tree));
+  for (n = 0, k = 0; k < NHUGE && (size_t)n < m; k++) {
+    if (k % 7 == 0)
+      continue;
+    CHECK(out[n] == k && outp[n] == big + k);
+    n++;
+  }
+  CHECK((size_t)n == m);
+
+  rbdestroy (tree, NULL);
+  free (outp);
+  free (out);
+  free (big);
+}
+
+/*
+ * Multiset counts, totals, ranks, selects and range counts against a
+ * model of occurrences per key, through compaction and cloning.
+ */
+static void test_multiset (void)
+{
+  static struct obj objs[NKEYS];
+  static size_t objaugs[NKEYS][2];
+  rbtree *tree = rbcreate (icompare), *clone;
+  int cnt[NKEYS] = { 0 }, i, k, lo, hi;
+  size_t total, rank, n;
+  rbnode *node;
+  void *data;
+
+  /* other trees have no order statistics */
+  for (k = 0; k < 16; k++)
+    rbinsert (tree, &k, sizeof k);
+  k = 8;
+  CHECK(rbrank (tree, &k) == 0 && rbselect (tree, 3) == NULL);
+  CHECK(rbcount_range (tree, NULL, NULL) == 0 && rbtotal (tree) == 16);
+  CHECK(rbsetmultiset (tree) == -1);
+  rbdestroy (tree, free);
+
+  tree = rbcreate (icompare);
+  CHECK(rbsetmultiset (tree) == 0);
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS / 4);
+    if (rnd (3)) {
+      if (k % 8 == 0 && !cnt[k]) {
+        objs[k].key = k;
+        objs[k].link.data = objs + k;
+        objs[k].link.aug = objaugs[k];
+        CHECK(rbinsert_node (tree, &objs[k].link) == NULL);
+      }
+      else {
+        node = rbinsert (tree, &k, sizeof k);
+        CHECK(cnt[k] ? node && *(int *)node->data == k : node == NULL);
+      }
+      cnt[k]++;
+    }
+    else if ((node = rbfind (tree, &k))) {
+      /* data comes back with the last occurrence only */
+      data = rbdelete (tree, node);
+      CHECK((data != NULL) == (cnt[k] == 1));
+      if (data)
+        ifree_owned (data);
+      cnt[k]--;
+    }
+    else {
+      CHECK(!cnt[k]);
+    }
+
+    if (i % 1000 == 0) {
+      rbcheck (tree);
+      if (i == 10000)
+        rbcompact (tree);
+    }
+
+    /* rank of a random key and the item a random rank selects */
+    k = rnd (NKEYS / 4);
+    for (rank = 0, total = 0, lo = 0; lo < NKEYS / 4; lo++) {
+      rank += lo < k ? cnt[lo] : 0;
+      total += cnt[lo];
+    }
+    CHECK(rbtotal (tree) == total && rbrank (tree, &k) == rank);
+    if (total) {
+      n = (size_t)rnd ((int)total);
+      node = rbselect (tree, n);
+      CHECK(node != NULL);
+      for (lo = 0; n >= (size_t)cnt[lo]; lo++)
+        n -= cnt[lo];
+      CHECK(node && *(int *)node->data == lo);
+    }
+    CHECK(rbselect (tree, total) == NULL);
+
+    lo = rnd (NKEYS / 4);
+    hi = lo + rnd (64);
+    for (n = 0, k = lo; k <= hi && k < NKEYS / 4; k++)
+      n += cnt[k];
+    CHECK(rbcount_range (tree, &lo, &hi) == n);
+    CHECK(rbcount_range (tree, &hi, &lo) == (lo == hi ? (size_t)cnt[lo] : 0));
+    CHECK(rbcount_range (tree, NULL, &hi) == rbrank (tree, &lo) + n);
+    CHECK(rbcount_range (tree, &lo, NULL) == total - rbrank (tree, &lo));
+  }
+  rbcheck (tree);
+
+  /* a clone has the same counts */
+  clone = rbclone (tree, NULL, NULL, sizeof k);
+  CHECK(clone != NULL);
+  rbcheck (clone);
+  CHECK(rbtotal (clone) == rbtotal (tree));
+  for (k = 0; k < NKEYS / 4; k++) {
+    lo = hi = k;
+    CHECK(rbcount_range (clone, &lo, &hi) == (size_t)cnt[k]);
+  }
+  rbdestroy (clone, free);
+
+  rbdestroy (tree, ifree_owned);
+}
+
+/*
+ * Interval mode: overlap queries against a brute-force scan of the model.
+ */
+static void test_interval (void)
+{
+  static char model[IVMAX][IVLEN];
+  rbtree *tree = rbcreate (ivcompare);
+  struct ival iv;
+  struct ivquery q;
+  rbnode *node;
+  int i, lo, len, n;
+
+  CHECK(rbsetinterval (tree, ivlow, ivhigh, icompare) == 0);
+
+  for (i = 0; i < 20000; i++) {
+    iv.lo = rnd (IVMAX);
+    len = rnd (IVLEN);
+    iv.hi = iv.lo + len;
+    if (rnd (3)) {
+      CHECK((rbinsert (tree, &iv, sizeof iv) == NULL) == !model[iv.lo][len]);
+      model[iv.lo][len] = 1;
+    }
+    else if ((node = rbfind (tree, &iv))) {
+      free (rbdelete (tree, node));
+      model[iv.lo][len] = 0;
+    }
+
+    if (i % 50)
+      continue;
+    if (i % 1000 == 0)
+      rbcheck (tree);
+
+    /* every interval overlapping a random query, in order */
+    q.lo = rnd (IVMAX + IVLEN);
+    q.hi = q.lo + rnd (IVLEN);
+    for (n = 0, lo = 0; lo < IVMAX; lo++)
+      for (len = 0; len < IVLEN; len++)
+        if (model[lo][len] && lo <= q.hi && q.lo <= lo + len)
+          n++;
+    q.n = 0;
+    CHECK(rbinterval_overlaps (tree, &q.lo, &q.hi, ivvisit, &q) == 0);
+    CHECK(q.n == n);
+
+    node = rbinterval_any (tree, &q.lo, &q.hi);
+    CHECK((node != NULL) == (n != 0));
+    if (node)
+      CHECK(((struct ival *)node->data)->lo <= q.hi &&
+            q.lo <= ((struct ival *)node->data)->hi);
+  }
+  rbcheck (tree);
+
+  rbdestroy (tree, free);
+}
+
+/* aggregate of a run of keys, sorted is cleared by combining out of order */
+struct agg {
+  long sum;
+  int n, min, max, sorted;
+};
+
+static void aggcombine (void *out, const void *a, const void *b)
+{
+  const struct agg *x = a,
+                   *y = b;
+  struct agg t;
+
+  t.sum = x->sum + y->sum;
+  t.n = x->n + y->n;
+  t.min = x->min < y->min ? x->min : y->min;
+  t.max = x->max > y->max ? x->max : y->max;
+  t.sorted = x->sorted && y->sorted && (!x->n || !y->n || x->max < y->min);
+  *(struct agg *)out = t;
+}
+
+static void aggvalue (const rbnode *node, void *out)
+{
+  struct agg *v = out;
+
+  v->sum = v->min = v->max = *(int *)node->data;
+  v->n = v->sorted = 1;
+}
+
+/*
+ * Aggregate mode: range values against sums over the model, with a few
+ * caller-owned nodes bringing their own value storage.
+ */
+static void test_aggregate (void)
+{
+  static struct obj objs[NKEYS];
+  static struct agg objaggs[NKEYS];
+  struct agg identity = { 0, 0, NKEYS, -1, 1 }, out;
+  rbtree *tree = rbcreate (icompare), *clone;
+  int model[NKEYS] = { 0 }, i, k, n, lo, hi, *plo, *phi;
+  long sum;
+  rbnode *node, spare;
+
+  CHECK(rbsetaggregate (tree, sizeof identity, &identity, aggcombine,
+                        aggvalue) == 0);
+  CHECK(rbsetinterval (tree, ivlow, ivhigh, icompare) == -1);
+
+  for (i = 0; i < 20000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (3)) {
+      if (k % 8 == 0) {
+        objs[k].key = k;
+        objs[k].link.data = objs + k;
+        objs[k].link.aug = objaggs + k;
+        node = rbinsert_node (tree, &objs[k].link);
+      }
+      else {
+        node = rbinsert (tree, &k, sizeof k);
+      }
+      CHECK((node == NULL) == !model[k]);
+      model[k] = 1;
+    }
+    else if ((node = rbfind (tree, &k))) {
+      ifree_owned (rbdelete (tree, node));
+      model[k] = 0;
+    }
+
+    if (i % 1000 == 0)
+      rbcheck (tree);
+
+    /* random range, either end possibly open */
+    lo = rnd (NKEYS);
+    hi = lo + rnd (NKEYS / 4);
+    plo = rnd (8) ? &lo : NULL;
+    phi = rnd (8) ? &hi : NULL;
+    CHECK(rbaggregate_range (tree, plo, phi, &out) == 0);
+    for (n = 0, sum = 0, k = 0; k < NKEYS; k++) {
+      if (model[k] && (!plo || k >= lo) && (!phi || k <= hi)) {
+        sum += k;
+        n++;
+      }
+    }
+    CHECK(out.sorted && out.sum == sum && out.n == n);
+  }
+  rbcheck (tree);
+
+  /* the replacement would not carry the subtree value */
+  node = rbmin (tree);
+  CHECK(node != rbnil(tree) && rbreplace (tree, node, &spare) == NULL);
+
+  /* a clone carries every subtree value, with keys copied out of objs */
+  clone = rbclone (tree, NULL, NULL, sizeof k);
+  CHECK(clone != NULL);
+  rbcheck (clone);
+  rbcheck_model (clone, model);
+  CHECK(rbaggregate_range (clone, NULL, NULL, &out) == 0);
+  for (n = 0, sum = 0, k = 0; k < NKEYS; k++) {
+    if (model[k]) {
+      sum += k;
+      n++;
+    }
+  }
+  CHECK(out.sorted && out.sum == sum && out.n == n);
+  rbdestroy (clone, free);
+
+  rbdestroy (tree, ifree_owned);
+}
+
+#define NREADERS 4
+
+struct reader {
+  rbtree *tree;
+  int t,
+      nfailed;                    /* checks failed on this thread */
+};
+
+/* every range lo .. lo + t of keys 0 .. NKEYS - 1, summed in closed form */
+static void *aggreader (void *arg)
+{
+  struct reader *r = arg;
+  struct agg out;
+  int lo, hi;
+
+  for (lo = 0; lo < NKEYS; lo++) {
+    hi = lo + r->t < NKEYS ? lo + r->t : NKEYS - 1;
+    CHECKN(r->nfailed, rbaggregate_range (r->tree, &lo, &hi, &out) == 0);
+    CHECKN(r->nfailed, out.sorted && out.n == hi - lo + 1 &&
+                       out.sum == (long)(lo + hi) * (hi - lo + 1) / 2);
+  }
+
+  return NULL;
+}
+
+/*
+ * Range aggregates are reads: threads may run them on one tree at once.
+ */
+static void test_aggregate_readers (void)
+{
+  struct agg identity = { 0, 0, NKEYS, -1, 1 };
+  rbtree *tree = rbcreate (icompare);
+  struct reader readers[NREADERS];
+  pthread_t th[NREADERS];
+  int k;
+
+  CHECK(rbsetaggregate (tree, sizeof identity, &identity, aggcombine,
+                        aggvalue) == 0);
+  for (k = 0; k < NKEYS; k++)
+    rbinsert (tree, &k, sizeof k);
+
+  for (k = 0; k < NREADERS; k++) {
+    readers[k].tree = tree;
+    readers[k].t = 7 * k;
+    readers[k].nfailed = 0;
+    pthread_create (th + k, NULL, aggreader, readers + k);
+  }
+  for (k = 0; k < NREADERS; k++) {
+    pthread_join (th[k], NULL);
+    failed += readers[k].nfailed;
+  }
+
+  rbdestroy (tree, free);
+}
+
+int main (void)
+{
+  test_basic ();
+  test_intrusive ();
+  test_capacity ();
+  test_lazy ();
+  test_async ();
+  test_stats ();
+  test_prefix ();
+  test_compact ();
+  test_clone ();
+  test_flatten ();
+  test_multiset ();
+  test_interval ();
+  test_aggregate ();
+  test_aggregate_readers ();
+
+  printf (" rbtree-test: %s\n", failed ? "FAILED" : "ok");
+
+  return failed != 0;
+}
@@ -0,0 +1,99 @@
+/**
+ *  Checks for the wide-node tree: random inserts, finds and deletes are
+ *  compared against an array model of the keys, with and without inline
+ *  prefixes, and rbwapply() must visit the keys in order.
+ *
+ *  build:  make test
+ *  usage:  ./test/rbwide-test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "rbwide.h"
+
+#define NKEYS 4096            /* keys are 0 .. NKEYS - 1 */
+#define CHECK_WALK
+
+#include "check.h"
+
+/* order-preserving prefix of a non-negative int key */
+static unsigned long iprefix (const void *a)
+{
+  return (unsigned long)*(const int *)a;
+}
+
+/*
+ * Compare the whole tree against the model.
+ */
+static void rbwcheck (rbwide *tree, const int *model)
+{
+  struct walk w;
+  size_t n = 0;
+  int k, lo = -1, hi = -1;
+
+  for (k = 0; k < NKEYS; k++) {
+    if (model[k]) {
+      if (lo < 0)
+        lo = k;
+      hi = k;
+      n++;
+    }
+    CHECK((rbwfind (tree, &k) != NULL) == (model[k] != 0));
+  }
+  CHECK(rbwcount(tree) == n);
+  CHECK(n ? *(int *)rbwmin (tree) == lo : rbwmin (tree) == NULL);
+  CHECK(n ? *(int *)rbwmax (tree) == hi : rbwmax (tree) == NULL);
+
+  w.model = model;
+  w.next = 0;
+  CHECK(rbwapply (tree, visit, &w) == 0);
+  visit_end (&w);
+}
+
+static void test_wide (int prefix)
+{
+  rbwide *tree = rbwcreate (icompare);
+  int model[NKEYS] = { 0 }, i, k;
+  void *data;
+
+  if (prefix)
+    CHECK(rbwsetprefix (tree, iprefix) == 0);
+
+  for (i = 0; i < 60000; i++) {
+    k = rnd (NKEYS);
+    if (rnd (2)) {
+      data = rbwinsert (tree, &k, sizeof k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      model[k] = 1;
+    }
+    else {
+      data = rbwdelete (tree, &k);
+      CHECK(model[k] ? data && *(int *)data == k : data == NULL);
+      free (data);
+      model[k] = 0;
+    }
+    if (i % 10000 == 0)
+      rbwcheck (tree, model);
+  }
+  rbwcheck (tree, model);
+
+  /* empty it from the front so every node shrinks and merges away */
+  for (k = 0; k < NKEYS; k++) {
+    free (rbwdelete (tree, &k));
+    model[k] = 0;
+  }
+  rbwcheck (tree, model);
+
+  rbwdestroy (tree, free);
+}
+
+int main (void)
+{
+  test_wide (0);
+  test_wide (1);
+
+  printf (" rbwide-test: %s\n", failed ? "FAILED" : "ok");
+
+  return failed != 0;
+}